@@ -0,0 +1,295 @@
+/*  Copyright (c) 2012-2014 Alexander Sabourenkov (screwdriver@lxnt.info)
+
+    This software is provided 'as-is', without any express or implied
+    warranty. In no event will the authors be held liable for any
+    damages arising from the use of this software.
+
+    Permission is granted to anyone to use this software for any
+    purpose, including commercial applications, and to alter it and
+    redistribute it freely, subject to the following restrictions:
+
+    1. The origin of this software must not be misrepresented; you must
+    not claim that you wrote the original software. If you use this
+    software in a product, an acknowledgment in the product documentation
+    would be appreciated but is not required.
+
+    2. Altered source versions must be plainly marked as such, and
+    must not be misrepresented as being the original software.
+
+    3. This notice may not be removed or altered from any source
+    distribution.
+*/
+
+#include <string.h>
+
+#include "blit.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BLIT_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+//{ generic
+static void span_generic(uint32_t *dst, uint32_t len, uint32_t keep, uint32_t value) {
+    for (uint32_t i = 0; i < len; i++)
+        dst[i] = (dst[i] & keep) | value;
+}
+
+static void tile_row_generic(uint32_t *dst, const uint8_t *coverage, uint32_t len, uint32_t keep, uint32_t attr, uint32_t shift) {
+    for (uint32_t i = 0; i < len; i++)
+        if (coverage[i])
+            dst[i] = (dst[i] & keep) | attr | (uint32_t)((coverage[i] << 8) | coverage[i]) << shift;
+}
+
+static void colorize_generic(uint32_t *px, uint32_t count, uint32_t color) {
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t alpha = (px[i] & 0xFFu) << 24;
+        px[i] = alpha ? color | alpha : 0;
+    }
+}
+
+/* the byte and short wide ones below vectorize well enough as they are */
+static void span8_generic(uint8_t *dst, uint32_t len, uint8_t coverage) {
+    for (uint32_t i = 0; i < len; i++)
+        dst[i] |= coverage;
+}
+
+static void tile_row8_generic(uint8_t *dst, const uint8_t *coverage, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++)
+        dst[i] |= coverage[i];
+}
+
+static void fill16_generic(uint16_t *dst, uint32_t len, uint16_t value) {
+    for (uint32_t i = 0; i < len; i++)
+        dst[i] = value;
+}
+
+static void tile_row16_generic(uint16_t *dst, const uint8_t *coverage, uint32_t len, uint16_t value) {
+    for (uint32_t i = 0; i < len; i++)
+        dst[i] = coverage[i] ? value : dst[i];
+}
+
+/* x / 255, rounded, for x in [0, 255*255] */
+static inline uint32_t div255(uint32_t x) {
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+static void premultiply_generic(uint32_t *dst, const uint8_t *coverage, uint32_t count, uint32_t color) {
+    const uint32_t c0 = color & 0xFF, c1 = (color >> 8) & 0xFF, c2 = (color >> 16) & 0xFF;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t a = coverage[i];
+        dst[i] = a << 24 | div255(c2 * a) << 16 | div255(c1 * a) << 8 | div255(c0 * a);
+    }
+}
+
+/* premultiplied color at coverage a, plus dst scaled by 1 - a, per channel */
+static inline uint32_t over(uint32_t dst, uint32_t a, uint32_t c0, uint32_t c1, uint32_t c2) {
+    const uint32_t inv = 255 - a;
+    return (a + div255((dst >> 24) * inv)) << 24
+         | (div255(c2 * a) + div255((dst >> 16 & 0xFF) * inv)) << 16
+         | (div255(c1 * a) + div255((dst >> 8 & 0xFF) * inv)) << 8
+         | (div255(c0 * a) + div255((dst & 0xFF) * inv));
+}
+
+static void over_span_generic(uint32_t *dst, uint32_t len, uint8_t coverage, uint32_t color) {
+    const uint32_t c0 = color & 0xFF, c1 = (color >> 8) & 0xFF, c2 = (color >> 16) & 0xFF;
+    for (uint32_t i = 0; i < len; i++)
+        dst[i] = over(dst[i], coverage, c0, c1, c2);
+}
+
+static void over_row_generic(uint32_t *dst, const uint8_t *coverage, uint32_t len, uint32_t color) {
+    const uint32_t c0 = color & 0xFF, c1 = (color >> 8) & 0xFF, c2 = (color >> 16) & 0xFF;
+    for (uint32_t i = 0; i < len; i++)
+        if (coverage[i])
+            dst[i] = over(dst[i], coverage[i], c0, c1, c2);
+}
+
+#define PLANE_KERNELS span8_generic, tile_row8_generic, fill16_generic, tile_row16_generic, premultiply_generic, \
+                      over_span_generic, over_row_generic
+
+static const blit_kernels_t kernels_generic = { span_generic, tile_row_generic, colorize_generic, PLANE_KERNELS, "generic" };
+//}
+#if defined(BLIT_X86)
+//{ sse2
+__attribute__((target("sse2")))
+static void span_sse2(uint32_t *dst, uint32_t len, uint32_t keep, uint32_t value) {
+    const __m128i k = _mm_set1_epi32(keep);
+    const __m128i v = _mm_set1_epi32(value);
+    uint32_t i = 0;
+
+    for (; i + 4 <= len; i += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(_mm_and_si128(p, k), v));
+    }
+    span_generic(dst + i, len - i, keep, value);
+}
+
+__attribute__((target("sse2")))
+static void tile_row_sse2(uint32_t *dst, const uint8_t *coverage, uint32_t len, uint32_t keep, uint32_t attr, uint32_t shift) {
+    const __m128i k = _mm_set1_epi32(keep);
+    const __m128i a = _mm_set1_epi32(attr);
+    const __m128i s = _mm_cvtsi32_si128(shift);
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t i = 0;
+
+    for (; i + 4 <= len; i += 4) {
+        int32_t c4;
+        memcpy(&c4, coverage + i, sizeof(c4));
+        if (!c4)
+            continue;
+        __m128i c = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(c4), zero), zero);
+        __m128i p = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i n = _mm_or_si128(_mm_or_si128(_mm_and_si128(p, k), a), _mm_sll_epi32(_mm_or_si128(c, _mm_slli_epi32(c, 8)), s));
+        __m128i empty = _mm_cmpeq_epi32(c, zero);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(_mm_and_si128(empty, p), _mm_andnot_si128(empty, n)));
+    }
+    tile_row_generic(dst + i, coverage + i, len - i, keep, attr, shift);
+}
+
+__attribute__((target("sse2")))
+static void colorize_sse2(uint32_t *px, uint32_t count, uint32_t color) {
+    const __m128i c = _mm_set1_epi32(color);
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        __m128i alpha = _mm_slli_epi32(_mm_loadu_si128((const __m128i *)(px + i)), 24);
+        __m128i empty = _mm_cmpeq_epi32(alpha, zero);
+        _mm_storeu_si128((__m128i *)(px + i), _mm_andnot_si128(empty, _mm_or_si128(alpha, c)));
+    }
+    colorize_generic(px + i, count - i, color);
+}
+
+static const blit_kernels_t kernels_sse2 = { span_sse2, tile_row_sse2, colorize_sse2, PLANE_KERNELS, "sse2" };
+//}
+//{ avx2
+__attribute__((target("avx2")))
+static void span_avx2(uint32_t *dst, uint32_t len, uint32_t keep, uint32_t value) {
+    const __m256i k = _mm256_set1_epi32(keep);
+    const __m256i v = _mm256_set1_epi32(value);
+    uint32_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        __m256i p = _mm256_loadu_si256((const __m256i *)(dst + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_or_si256(_mm256_and_si256(p, k), v));
+    }
+    span_sse2(dst + i, len - i, keep, value);
+}
+
+__attribute__((target("avx2")))
+static void tile_row_avx2(uint32_t *dst, const uint8_t *coverage, uint32_t len, uint32_t keep, uint32_t attr, uint32_t shift) {
+    const __m256i k = _mm256_set1_epi32(keep);
+    const __m256i a = _mm256_set1_epi32(attr);
+    const __m128i s = _mm_cvtsi32_si128(shift);
+    const __m256i zero = _mm256_setzero_si256();
+    uint32_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        int64_t c8;
+        memcpy(&c8, coverage + i, sizeof(c8));
+        if (!c8)
+            continue;
+        __m256i c = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(coverage + i)));
+        __m256i p = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i n = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(p, k), a),
+                                    _mm256_sll_epi32(_mm256_or_si256(c, _mm256_slli_epi32(c, 8)), s));
+        __m256i empty = _mm256_cmpeq_epi32(c, zero);
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_blendv_epi8(n, p, empty));
+    }
+    tile_row_sse2(dst + i, coverage + i, len - i, keep, attr, shift);
+}
+
+__attribute__((target("avx2")))
+static void colorize_avx2(uint32_t *px, uint32_t count, uint32_t color) {
+    const __m256i c = _mm256_set1_epi32(color);
+    const __m256i zero = _mm256_setzero_si256();
+    uint32_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m256i alpha = _mm256_slli_epi32(_mm256_loadu_si256((const __m256i *)(px + i)), 24);
+        __m256i empty = _mm256_cmpeq_epi32(alpha, zero);
+        _mm256_storeu_si256((__m256i *)(px + i), _mm256_andnot_si256(empty, _mm256_or_si256(alpha, c)));
+    }
+    colorize_sse2(px + i, count - i, color);
+}
+
+static const blit_kernels_t kernels_avx2 = { span_avx2, tile_row_avx2, colorize_avx2, PLANE_KERNELS, "avx2" };
+//}
+#endif
+#if defined(__ARM_NEON)
+//{ neon
+static void span_neon(uint32_t *dst, uint32_t len, uint32_t keep, uint32_t value) {
+    const uint32x4_t k = vdupq_n_u32(keep);
+    const uint32x4_t v = vdupq_n_u32(value);
+    uint32_t i = 0;
+
+    for (; i + 4 <= len; i += 4)
+        vst1q_u32(dst + i, vorrq_u32(vandq_u32(vld1q_u32(dst + i), k), v));
+    span_generic(dst + i, len - i, keep, value);
+}
+
+static void tile_row_neon(uint32_t *dst, const uint8_t *coverage, uint32_t len, uint32_t keep, uint32_t attr, uint32_t shift) {
+    const uint32x4_t k = vdupq_n_u32(keep);
+    const uint32x4_t a = vdupq_n_u32(attr);
+    const int32x4_t s = vdupq_n_s32(shift);
+    uint32_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        uint16x8_t c16 = vmovl_u8(vld1_u8(coverage + i));
+        for (int half = 0; half < 2; half++) {
+            uint32x4_t c = vmovl_u16(half ? vget_high_u16(c16) : vget_low_u16(c16));
+            uint32x4_t p = vld1q_u32(dst + i + 4 * half);
+            uint32x4_t n = vorrq_u32(vorrq_u32(vandq_u32(p, k), a), vshlq_u32(vorrq_u32(c, vshlq_n_u32(c, 8)), s));
+            vst1q_u32(dst + i + 4 * half, vbslq_u32(vceqq_u32(c, vdupq_n_u32(0)), p, n));
+        }
+    }
+    tile_row_generic(dst + i, coverage + i, len - i, keep, attr, shift);
+}
+
+static void colorize_neon(uint32_t *px, uint32_t count, uint32_t color) {
+    const uint32x4_t c = vdupq_n_u32(color);
+    uint32_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        uint32x4_t alpha = vshlq_n_u32(vld1q_u32(px + i), 24);
+        /* vtstq: all ones where alpha is nonzero */
+        vst1q_u32(px + i, vandq_u32(vtstq_u32(alpha, alpha), vorrq_u32(alpha, c)));
+    }
+    colorize_generic(px + i, count - i, color);
+}
+
+static const blit_kernels_t kernels_neon = { span_neon, tile_row_neon, colorize_neon, PLANE_KERNELS, "neon" };
+//}
+#endif
+
+static const blit_kernels_t *pick_kernels(void) {
+#if defined(BLIT_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return &kernels_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return &kernels_sse2;
+#endif
+#if defined(__ARM_NEON)
+    return &kernels_neon;
+#endif
+    return &kernels_generic;
+}
+
+const blit_kernels_t *blit_kernels(void) {
+    /* called per bitmap by the color post-processors, so the CPU is only asked once.
+       racing first calls pick the same table */
+    static const blit_kernels_t *picked;
+    const blit_kernels_t *rv = __atomic_load_n(&picked, __ATOMIC_ACQUIRE);
+
+    if (!rv) {
+        rv = pick_kernels();
+        __atomic_store_n(&picked, rv, __ATOMIC_RELEASE);
+    }
+    return rv;
+}
@@ -0,0 +1,65 @@
+/*  Copyright (c) 2012-2014 Alexander Sabourenkov (screwdriver@lxnt.info)
+
+    This software is provided 'as-is', without any express or implied
+    warranty. In no event will the authors be held liable for any
+    damages arising from the use of this software.
+
+    Permission is granted to anyone to use this software for any
+    purpose, including commercial applications, and to alter it and
+    redistribute it freely, subject to the following restrictions:
+
+    1. The origin of this software must not be misrepresented; you must
+    not claim that you wrote the original software. If you use this
+    software in a product, an acknowledgment in the product documentation
+    would be appreciated but is not required.
+
+    2. Altered source versions must be plainly marked as such, and
+    must not be misrepresented as being the original software.
+
+    3. This notice may not be removed or altered from any source
+    distribution.
+*/
+
+/* Pixel compositing kernels for render_shape(), zhban_render_into() and the color post-processors.
+
+    Not part of the public API. Bitmap pixels are RG16: coverage in the low
+    16 bits, cluster index in the high 16, or RGBA8 with coverage in alpha
+    when colorized while rendering. Both compositing kernels compute
+
+        p = (p & keep) | value
+
+    for a run of pixels, the tile one skipping pixels with zero coverage.
+    blit_kernels() picks the widest implementation the CPU supports,
+    checking at run time on x86, once, so that the library itself is built
+    for the baseline instruction set.
+*/
+
+#if !defined(ZHBAN_BLIT_H)
+#define ZHBAN_BLIT_H
+
+#include <stdint.h>
+
+typedef struct _blit_kernels {
+    /* len pixels of constant value */
+    void (*span)(uint32_t *dst, uint32_t len, uint32_t keep, uint32_t value);
+    /* len pixels of value = attr | (coverage bit-replicated to 16 bits) << shift, where coverage is nonzero */
+    void (*tile_row)(uint32_t *dst, const uint8_t *coverage, uint32_t len, uint32_t keep, uint32_t attr, uint32_t shift);
+    /* RG16 to RGBA8 in place: color | coverage << 24, or 0 where coverage is 0 */
+    void (*colorize)(uint32_t *px, uint32_t count, uint32_t color);
+
+    /* 8-bit coverage and 16-bit cluster planes */
+    void (*span8)(uint8_t *dst, uint32_t len, uint8_t coverage);                /* dst |= coverage */
+    void (*tile_row8)(uint8_t *dst, const uint8_t *coverage, uint32_t len);     /* dst |= coverage */
+    void (*fill16)(uint16_t *dst, uint32_t len, uint16_t value);
+    void (*tile_row16)(uint16_t *dst, const uint8_t *coverage, uint32_t len, uint16_t value);  /* where coverage is nonzero */
+    /* premultiplied color from 8-bit coverage. color's channels are in the desired order, alpha ignored */
+    void (*premultiply)(uint32_t *dst, const uint8_t *coverage, uint32_t count, uint32_t color);
+    /* same, composited source over premultiplied dst: a run of constant coverage, and a row of it */
+    void (*over_span)(uint32_t *dst, uint32_t len, uint8_t coverage, uint32_t color);
+    void (*over_row)(uint32_t *dst, const uint8_t *coverage, uint32_t len, uint32_t color);
+    const char *name;
+} blit_kernels_t;
+
+const blit_kernels_t *blit_kernels(void);
+
+#endif
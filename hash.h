@@ -0,0 +1,126 @@
+/*  Copyright (c) 2012-2014 Alexander Sabourenkov (screwdriver@lxnt.info)
+
+    This software is provided 'as-is', without any express or implied
+    warranty. In no event will the authors be held liable for any
+    damages arising from the use of this software.
+
+    Permission is granted to anyone to use this software for any
+    purpose, including commercial applications, and to alter it and
+    redistribute it freely, subject to the following restrictions:
+
+    1. The origin of this software must not be misrepresented; you must
+    not claim that you wrote the original software. If you use this
+    software in a product, an acknowledgment in the product documentation
+    would be appreciated but is not required.
+
+    2. Altered source versions must be plainly marked as such, and
+    must not be misrepresented as being the original software.
+
+    3. This notice may not be removed or altered from any source
+    distribution.
+*/
+
+/* String hashing for the caches.
+
+    Not part of the public API. A wyhash-style 64-bit hash: the input is
+    read 8 or 4 bytes at a time and mixed by 64x64->128 bit multiplication,
+    which makes for a few cycles per short key, and a good spread in the low
+    bits uthash uses for buckets. hash_bytes() is also uthash's HASH_FUNCTION,
+    folded to 32 bits, and what zhban_intern() precomputes.
+*/
+
+#if !defined(ZHBAN_HASH_H)
+#define ZHBAN_HASH_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define HASH_SECRET0 0xa0761d6478bd642full
+#define HASH_SECRET1 0xe7037ed1a0b428dbull
+#define HASH_SECRET2 0x8ebc6af09c88c6e3ull
+#define HASH_SECRET3 0x589965cc75374cc3ull
+
+/* 64x64->128 bit multiplication, low half in a, high half in b */
+static inline void hash_mum(uint64_t *a, uint64_t *b) {
+#if defined(__SIZEOF_INT128__)
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+    hash_mum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t hash_read8(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t hash_read4(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint64_t hash_bytes(const void *key, size_t len) {
+    const uint8_t *p = (const uint8_t *)key;
+    uint64_t seed = hash_mix(HASH_SECRET0, HASH_SECRET1);
+    uint64_t a, b;
+
+    if (len <= 16) {
+        if (len >= 4) {
+            /* two overlapping reads from each end cover 4 to 16 bytes */
+            a = (hash_read4(p) << 32) | hash_read4(p + ((len >> 3) << 2));
+            b = (hash_read4(p + len - 4) << 32) | hash_read4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            /* three independent lanes keep the multiplier busy */
+            uint64_t seed1 = seed, seed2 = seed;
+            do {
+                seed  = hash_mix(hash_read8(p) ^ HASH_SECRET1, hash_read8(p + 8) ^ seed);
+                seed1 = hash_mix(hash_read8(p + 16) ^ HASH_SECRET2, hash_read8(p + 24) ^ seed1);
+                seed2 = hash_mix(hash_read8(p + 32) ^ HASH_SECRET3, hash_read8(p + 40) ^ seed2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (i > 16) {
+            seed = hash_mix(hash_read8(p) ^ HASH_SECRET1, hash_read8(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = hash_read8(p + i - 16);
+        b = hash_read8(p + i - 8);
+    }
+    a ^= HASH_SECRET1;
+    b ^= seed;
+    hash_mum(&a, &b);
+    return hash_mix(a ^ HASH_SECRET0 ^ len, b ^ HASH_SECRET1);
+}
+
+/* for uthash */
+static inline unsigned hash_fold(uint64_t h) {
+    return (unsigned)(h ^ (h >> 32));
+}
+
+#endif
@@ -0,0 +1,276 @@
+/*  Copyright (c) 2012-2014 Alexander Sabourenkov (screwdriver@lxnt.info)
+
+    This software is provided 'as-is', without any express or implied
+    warranty. In no event will the authors be held liable for any
+    damages arising from the use of this software.
+
+    Permission is granted to anyone to use this software for any
+    purpose, including commercial applications, and to alter it and
+    redistribute it freely, subject to the following restrictions:
+
+    1. The origin of this software must not be misrepresented; you must
+    not claim that you wrote the original software. If you use this
+    software in a product, an acknowledgment in the product documentation
+    would be appreciated but is not required.
+
+    2. Altered source versions must be plainly marked as such, and
+    must not be misrepresented as being the original software.
+
+    3. This notice may not be removed or altered from any source
+    distribution.
+*/
+
+/*  Paragraph layout: splits text into words at whitespace, shapes each with zhban_shape(),
+    so that words come out of the shape cache on reflow, and breaks them into lines.
+
+    Line breaking is that of python/zhban/divide.py, which is from http://xxyxyz.org/line-breaking/:
+    greedy, or minimum raggedness, that is, least sum of squared free space at line ends, found
+    with the SMAWK algorithm in linear time. Words are as wide as their bounding boxes, and are
+    separated by zhban_t::space_advance. The first line indent is a blank pseudo-word. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "zhban.h"
+
+/* per pixel a line is too long by. unlike linear(), it is added to the cost of the lines before, so that
+   the cost stays convex in line width, and the matrix totally monotone: SMAWK needs that to be exact */
+#define OVERFULL_PENALTY    (1LL << 32)
+#define COST_INFINITY       (INT64_MAX / 4)
+
+typedef struct _breaker {
+    const int64_t *offsets;     /* count + 1 prefix sums of word widths */
+    int64_t width, space;
+    int64_t *minima;            /* least cost of a layout ending before word j */
+    uint32_t *breaks;           /* first word of the line ending before word j in it */
+} breaker_t;
+
+/* cost of the best layout of words before i, plus a line of words i to j - 1 */
+static int64_t line_cost(const breaker_t *b, uint32_t i, uint32_t j) {
+    const int64_t w = b->offsets[j] - b->offsets[i] + (j - i - 1) * b->space;
+
+    if (w > b->width)
+        return b->minima[i] + OVERFULL_PENALTY * (w - b->width);
+    return b->minima[i] + (b->width - w) * (b->width - w);
+}
+
+/* column minima for the row and column subsets. nonzero on error */
+static int smawk(breaker_t *b, const uint32_t *rows, uint32_t nrows, const uint32_t *cols, uint32_t ncols) {
+    uint32_t *stack = malloc((ncols + ncols / 2) * sizeof(uint32_t));
+    uint32_t *odd = stack + ncols;
+    uint32_t top = 0, i, j;
+
+    if (!stack)
+        return 1;
+
+    /* reduce: drop rows that can't have a column minimum */
+    for (i = 0; i < nrows; ) {
+        if (top) {
+            const uint32_t c = cols[top - 1];
+            if (line_cost(b, stack[top - 1], c) < line_cost(b, rows[i], c)) {
+                if (top < ncols)
+                    stack[top++] = rows[i];
+                i++;
+            } else {
+                top--;
+            }
+        } else {
+            stack[top++] = rows[i++];
+        }
+    }
+
+    if (ncols > 1) {
+        for (j = 1; j < ncols; j += 2)
+            odd[j / 2] = cols[j];
+        if (smawk(b, stack, top, odd, ncols / 2)) {
+            free(stack);
+            return 1;
+        }
+    }
+
+    /* even columns: their minima lie between those of the odd ones around */
+    for (i = j = 0; j < ncols; ) {
+        const uint32_t end = j + 1 < ncols ? b->breaks[cols[j + 1]] : stack[top - 1];
+        const int64_t c = line_cost(b, stack[i], cols[j]);
+        if (c < b->minima[cols[j]]) {
+            b->minima[cols[j]] = c;
+            b->breaks[cols[j]] = stack[i];
+        }
+        if (stack[i] < end)
+            i++;
+        else
+            j += 2;
+    }
+    free(stack);
+    return 0;
+}
+
+/* fills breaks for minimum raggedness. nonzero on error */
+static int break_balanced(breaker_t *b, uint32_t count) {
+    uint32_t *rows = malloc(2 * (count + 1) * sizeof(uint32_t));
+    uint32_t *cols = rows + count + 1;
+    uint32_t n = count + 1, i = 0, offset = 0;
+
+    if (!rows)
+        return 1;
+    b->minima[0] = 0;
+    for (uint32_t k = 1; k <= count; k++)
+        b->minima[k] = COST_INFINITY;
+
+    /* the matrix is only totally monotone up to a column that is better off starting a line
+       at one of the rows being looked at, so it's done in growing blocks, restarting from there */
+    while (1) {
+        const uint32_t r = n < (2u << i) ? n : (2u << i);
+        const uint32_t edge = (1u << i) + offset;
+        uint32_t k, restarted = 0;
+
+        for (k = offset; k < edge; k++)
+            rows[k - offset] = k;
+        for (k = edge; k < r + offset; k++)
+            cols[k - edge] = k;
+        if (smawk(b, rows, edge - offset, cols, r + offset - edge)) {
+            free(rows);
+            return 1;
+        }
+
+        const int64_t x = b->minima[r - 1 + offset];
+        for (k = 1u << i; k < r - 1; k++) {
+            if (line_cost(b, k + offset, r - 1 + offset) <= x) {
+                n -= k;
+                i = 0;
+                offset += k;
+                restarted = 1;
+                break;
+            }
+        }
+        if (!restarted) {
+            if (r == n)
+                break;
+            i += 1;
+        }
+    }
+    free(rows);
+    return 0;
+}
+
+/* fills breaks first fit: as many words on a line as fit, an overlong one alone */
+static void break_greedy(breaker_t *b, uint32_t count) {
+    uint32_t first = 0;
+
+    for (uint32_t j = 1; j <= count; j++) {
+        if (j - first > 1 && b->offsets[j] - b->offsets[first] + (j - first - 1) * b->space > b->width)
+            first = j - 1;
+        b->breaks[j] = first;
+    }
+}
+
+static inline int is_space(uint16_t c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == 0x3000;
+}
+
+zhban_layout_t *zhban_layout_paragraph(zhban_t *zhban, const uint16_t *string, const uint32_t strsize,
+                                                                int32_t width, int32_t indent, uint32_t mode) {
+    const uint32_t length = strsize / 2;
+    const uint32_t lead = indent > 0;   /* pseudo-word for the indent */
+    uint32_t count = 0, at, k;
+    zhban_layout_t *rv;
+    breaker_t b;
+
+    /* a word per non-space after a space, at most */
+    for (at = 0; at < length; at++)
+        if (!is_space(string[at]) && (at == 0 || is_space(string[at - 1])))
+            count++;
+
+    /* the indent can take a line of its own */
+    rv = malloc(sizeof(zhban_layout_t) + count * sizeof(zhban_word_t) + (count + 1) * sizeof(zhban_line_t));
+    int64_t *offsets = malloc((count + lead + 1) * (2 * sizeof(int64_t) + sizeof(uint32_t)));
+    if (!rv || !offsets) {
+        free(rv);
+        free(offsets);
+        return NULL;
+    }
+    memset(rv, 0, sizeof(zhban_layout_t));
+    rv->words = (zhban_word_t *)(rv + 1);
+    rv->lines = (zhban_line_t *)(rv->words + count);
+
+    /* shape the words */
+    offsets[0] = 0;
+    if (lead)
+        offsets[1] = indent;
+    for (at = 0; at < length; ) {
+        while (at < length && is_space(string[at]))
+            at++;
+        if (at == length)
+            break;
+        zhban_word_t *word = rv->words + rv->word_count;
+        word->start = at;
+        while (at < length && !is_space(string[at]))
+            at++;
+        word->length = at - word->start;
+        if (!(word->shape = zhban_shape(zhban, string + word->start, word->length * 2)))
+            goto error;
+        rv->word_count += 1;
+        offsets[lead + rv->word_count] = offsets[lead + rv->word_count - 1] + word->shape->w;
+    }
+
+    /* break them into lines */
+    count = rv->word_count ? rv->word_count + lead : 0;
+    b.offsets = offsets;
+    b.width = width;
+    b.space = zhban->space_advance;
+    b.minima = offsets + count + 1;
+    b.breaks = (uint32_t *)(b.minima + count + 1);
+    if (count && mode == ZHBAN_LAYOUT_BALANCED) {
+        if (break_balanced(&b, count))
+            goto error;
+    } else {
+        break_greedy(&b, count);
+    }
+    for (k = count; k > 0; k = b.breaks[k])
+        rv->line_count++;
+    for (k = count, at = rv->line_count; k > 0; k = b.breaks[k]) {
+        zhban_line_t *line = rv->lines + --at;
+        const uint32_t first = b.breaks[k] ? b.breaks[k] - lead : 0;
+        line->first_word = first;
+        line->word_count = k - lead - first;
+        line->width = offsets[k] - offsets[b.breaks[k]] + (k - b.breaks[k] - 1) * b.space;
+    }
+
+    /* place them: left to right, bounding boxes separated by a space, baselines a line_step apart
+       and the lowest descender at zero */
+    int32_t descent = 0;
+    for (k = 0; k < rv->word_count; k++)
+        if (rv->words[k].shape->origin_y > descent)
+            descent = rv->words[k].shape->origin_y;
+    rv->w = width;
+    for (uint32_t l = 0; l < rv->line_count; l++) {
+        zhban_line_t *line = rv->lines + l;
+        int32_t x = l == 0 && lead ? indent + b.space : 0;
+        line->baseline = descent + (rv->line_count - 1 - l) * zhban->line_step;
+        for (k = line->first_word; k < line->first_word + line->word_count; k++) {
+            zhban_word_t *word = rv->words + k;
+            word->x = x;
+            word->y = line->baseline - word->shape->origin_y;
+            x += word->shape->w + b.space;
+            if (word->y + word->shape->h > rv->h)
+                rv->h = word->y + word->shape->h;
+        }
+        if (line->width > rv->w)
+            rv->w = line->width;
+    }
+    free(offsets);
+    return rv;
+
+    error:
+    zhban_release_layout(zhban, rv);
+    free(offsets);
+    return NULL;
+}
+
+void zhban_release_layout(zhban_t *zhban, zhban_layout_t *layout) {
+    if (!layout)
+        return;
+    for (uint32_t k = 0; k < layout->word_count; k++)
+        zhban_release_shape(zhban, layout->words[k].shape);
+    free(layout);
+}
@@ -0,0 +1,226 @@
+/*  Copyright (c) 2012-2014 Alexander Sabourenkov (screwdriver@lxnt.info)
+
+    This software is provided 'as-is', without any express or implied
+    warranty. In no event will the authors be held liable for any
+    damages arising from the use of this software.
+
+    Permission is granted to anyone to use this software for any
+    purpose, including commercial applications, and to alter it and
+    redistribute it freely, subject to the following restrictions:
+
+    1. The origin of this software must not be misrepresented; you must
+    not claim that you wrote the original software. If you use this
+    software in a product, an acknowledgment in the product documentation
+    would be appreciated but is not required.
+
+    2. Altered source versions must be plainly marked as such, and
+    must not be misrepresented as being the original software.
+
+    3. This notice may not be removed or altered from any source
+    distribution.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+typedef struct _range {
+    pthread_mutex_t lock;
+    uint32_t lo, hi;        /* [lo, hi) not yet taken */
+} range_t;
+
+typedef struct _worker {
+    pool_t *pool;
+    uint32_t index;
+    pthread_t thread;
+} worker_t;
+
+struct _pool {
+    uint32_t nthreads;
+    worker_t *workers;      /* nthreads of them */
+    range_t *ranges;        /* nthreads + 1, [0] is the caller's */
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;    /* new generation or quit */
+    pthread_cond_t done;    /* busy dropped to zero */
+    uint32_t generation;
+    uint32_t busy;          /* workers still draining current generation */
+    int quit;
+
+    pool_job_t job;
+    void *ctx;
+};
+
+/* returns nonzero and sets *index if there was anything left in own range */
+static int take_own(range_t *r, uint32_t *index) {
+    int rv = 0;
+    pthread_mutex_lock(&r->lock);
+    if (r->lo < r->hi) {
+        *index = r->lo++;
+        rv = 1;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return rv;
+}
+
+/* moves back half of somebody's range into own one. returns nonzero on success */
+static int steal(pool_t *pool, uint32_t self) {
+    const uint32_t nranges = pool->nthreads + 1;
+    for (uint32_t i = 1; i < nranges; i++) {
+        range_t *victim = pool->ranges + (self + i) % nranges;
+        uint32_t lo, hi;
+
+        pthread_mutex_lock(&victim->lock);
+        hi = victim->hi;
+        lo = victim->lo + (victim->hi - victim->lo) / 2;
+        if (lo < hi)
+            victim->hi = lo;
+        pthread_mutex_unlock(&victim->lock);
+
+        if (lo < hi) {
+            range_t *own = pool->ranges + self;
+            pthread_mutex_lock(&own->lock);
+            own->lo = lo;
+            own->hi = hi;
+            pthread_mutex_unlock(&own->lock);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void drain(pool_t *pool, uint32_t self) {
+    uint32_t index;
+    do {
+        while (take_own(pool->ranges + self, &index))
+            pool->job(pool->ctx, index, self);
+    } while (steal(pool, self));
+}
+
+static void *worker_main(void *arg) {
+    worker_t *w = (worker_t *)arg;
+    pool_t *pool = w->pool;
+    uint32_t seen = 0;
+
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->quit && pool->generation == seen)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->quit) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        drain(pool, w->index);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0)
+            pthread_cond_signal(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+pool_t *pool_create(uint32_t nthreads) {
+    if (nthreads == 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpu > 1 ? (uint32_t)(ncpu - 1) : 0;
+    }
+
+    pool_t *pool = malloc(sizeof(pool_t));
+    if (!pool)
+        return NULL;
+    memset(pool, 0, sizeof(pool_t));
+
+    pool->ranges = malloc(sizeof(range_t) * (nthreads + 1));
+    pool->workers = malloc(sizeof(worker_t) * (nthreads + 1));
+    if (!pool->ranges || !pool->workers) {
+        free(pool->ranges);
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < nthreads + 1; i++) {
+        pthread_mutex_init(&pool->ranges[i].lock, NULL);
+        pool->ranges[i].lo = pool->ranges[i].hi = 0;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    /* workers[i] serves ranges[i + 1] */
+    for (uint32_t i = 0; i < nthreads; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i + 1;
+        if (pthread_create(&pool->workers[i].thread, NULL, worker_main, pool->workers + i))
+            break;
+        pool->nthreads += 1;
+    }
+    return pool;
+}
+
+void pool_destroy(pool_t *pool) {
+    if (!pool)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (uint32_t i = 0; i < pool->nthreads; i++)
+        pthread_join(pool->workers[i].thread, NULL);
+
+    for (uint32_t i = 0; i < pool->nthreads + 1; i++)
+        pthread_mutex_destroy(&pool->ranges[i].lock);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->done);
+    free(pool->ranges);
+    free(pool->workers);
+    free(pool);
+}
+
+uint32_t pool_size(pool_t *pool) {
+    return pool->nthreads;
+}
+
+void pool_run(pool_t *pool, pool_job_t job, void *ctx, uint32_t count) {
+    const uint32_t nranges = pool->nthreads + 1;
+
+    if (count == 0)
+        return;
+
+    if (pool->nthreads == 0 || count == 1) {
+        for (uint32_t i = 0; i < count; i++)
+            job(ctx, i, 0);
+        return;
+    }
+
+    /* workers are all parked at this point, so no locking is needed for the ranges */
+    for (uint32_t i = 0; i < nranges; i++) {
+        pool->ranges[i].lo = (uint64_t)count * i / nranges;
+        pool->ranges[i].hi = (uint64_t)count * (i + 1) / nranges;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->job = job;
+    pool->ctx = ctx;
+    pool->busy = pool->nthreads;
+    pool->generation += 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    drain(pool, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
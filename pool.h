@@ -0,0 +1,53 @@
+/*  Copyright (c) 2012-2014 Alexander Sabourenkov (screwdriver@lxnt.info)
+
+    This software is provided 'as-is', without any express or implied
+    warranty. In no event will the authors be held liable for any
+    damages arising from the use of this software.
+
+    Permission is granted to anyone to use this software for any
+    purpose, including commercial applications, and to alter it and
+    redistribute it freely, subject to the following restrictions:
+
+    1. The origin of this software must not be misrepresented; you must
+    not claim that you wrote the original software. If you use this
+    software in a product, an acknowledgment in the product documentation
+    would be appreciated but is not required.
+
+    2. Altered source versions must be plainly marked as such, and
+    must not be misrepresented as being the original software.
+
+    3. This notice may not be removed or altered from any source
+    distribution.
+*/
+
+/* Render worker pool.
+
+    Not part of the public API. pool_run() hands out [0, count) indices to
+    the workers and the calling thread, each starting with its own contiguous
+    range. A worker takes items from the front of its range; once it runs dry,
+    it steals the back half of somebody else's. Items are expected to be
+    heavyweight (a whole string to rasterize), so a mutex per range is cheap.
+*/
+
+#if !defined(ZHBAN_POOL_H)
+#define ZHBAN_POOL_H
+
+#include <stdint.h>
+
+typedef struct _pool pool_t;
+
+/* called once per index, possibly from several threads at once.
+   worker is in [0, pool_size()], 0 being the thread that called pool_run(). */
+typedef void (*pool_job_t)(void *ctx, uint32_t index, uint32_t worker);
+
+/* nthreads - worker threads to spawn in addition to the caller; 0 means one less than online CPUs */
+pool_t *pool_create(uint32_t nthreads);
+void pool_destroy(pool_t *pool);
+
+/* count of spawned worker threads */
+uint32_t pool_size(pool_t *pool);
+
+/* runs job for every index in [0, count), returns when all are done. not reentrant. */
+void pool_run(pool_t *pool, pool_job_t job, void *ctx, uint32_t count);
+
+#endif
@@ -0,0 +1,210 @@
+/*  Copyright (c) 2012-2014 Alexander Sabourenkov (screwdriver@lxnt.info)
+
+    This software is provided 'as-is', without any express or implied
+    warranty. In no event will the authors be held liable for any
+    damages arising from the use of this software.
+
+    Permission is granted to anyone to use this software for any
+    purpose, including commercial applications, and to alter it and
+    redistribute it freely, subject to the following restrictions:
+
+    1. The origin of this software must not be misrepresented; you must
+    not claim that you wrote the original software. If you use this
+    software in a product, an acknowledgment in the product documentation
+    would be appreciated but is not required.
+
+    2. Altered source versions must be plainly marked as such, and
+    must not be misrepresented as being the original software.
+
+    3. This notice may not be removed or altered from any source
+    distribution.
+*/
+
+/*  Text screen: a grid of rows kept rendered in a framebuffer between frames.
+
+    Each row remembers its text, its shape and how far to the right it was drawn. A new frame is
+    compared to the last one row by row; only rows with different text are shaped, in one
+    zhban_shape_batch() call, cleared and drawn again with zhban_render_into(), clipped to
+    their slot so that tall glyphs never spill into the neighbours. Changed rows make up
+    the dirty list, runs of adjacent ones merged into a rectangle each.
+
+    Everything but the row texts is allocated once, in zhban_screen_open(). */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "zhban.h"
+
+typedef struct _screen_row {
+    uint16_t *text;
+    uint32_t size, allocd;      /* in bytes */
+    zhban_shape_t *shape;       /* NULL if blank */
+    int32_t extent;             /* pixels drawn from the left edge, to be cleared */
+} screen_row_t;
+
+typedef struct _screen {
+    zhban_screen_t screen;
+    uint32_t color;
+    screen_row_t *row;
+
+    /* per update scratch, rows long */
+    uint32_t *changed;
+    const uint16_t **strings;
+    uint32_t *strsizes;
+    zhban_shape_t **shapes;
+} screen_t;
+
+static inline uint32_t format_bpp(uint32_t format) {
+    return format == ZHBAN_FORMAT_R8 ? 1 : 4;
+}
+
+zhban_screen_t *zhban_screen_open(zhban_t *zhban, int32_t w, uint32_t rows, uint32_t format, uint32_t color) {
+    screen_t *rv;
+
+    if (w <= 0 || !rows || format > ZHBAN_FORMAT_BGRA8 || format == ZHBAN_FORMAT_R8_CLUSTERS)
+        return NULL;
+    if (!(rv = calloc(1, sizeof(screen_t))))
+        return NULL;
+    rv->screen.w = w;
+    rv->screen.h = rows * zhban->line_step;
+    rv->screen.format = format;
+    rv->screen.rows = rows;
+    rv->color = color;
+
+    rv->screen.data = calloc((size_t)rv->screen.w * rv->screen.h, format_bpp(format));
+    rv->screen.dirty = malloc(rows * sizeof(zhban_rect_t));
+    rv->row = calloc(rows, sizeof(screen_row_t));
+    rv->changed = malloc(rows * sizeof(uint32_t));
+    rv->strings = malloc(rows * sizeof(uint16_t *));
+    rv->strsizes = malloc(rows * sizeof(uint32_t));
+    rv->shapes = malloc(rows * sizeof(zhban_shape_t *));
+    if (!rv->screen.data || !rv->screen.dirty || !rv->row || !rv->changed || !rv->strings || !rv->strsizes || !rv->shapes) {
+        zhban_screen_drop(zhban, &rv->screen);
+        return NULL;
+    }
+    return &rv->screen;
+}
+
+/* row slot: full width, line_step high, row 0 at the top */
+static zhban_rect_t row_rect(zhban_t *zhban, const zhban_screen_t *screen, uint32_t r) {
+    zhban_rect_t rect = { 0, (int32_t)((screen->rows - 1 - r) * zhban->line_step), screen->w, (int32_t)zhban->line_step };
+    return rect;
+}
+
+static void clear_rect(zhban_screen_t *screen, const zhban_rect_t *rect) {
+    const uint32_t bpp = format_bpp(screen->format);
+
+    for (int32_t y = rect->y; y < rect->y + rect->h; y++)
+        memset((uint8_t *)screen->data + ((size_t)y * screen->w + rect->x) * bpp, 0, (size_t)rect->w * bpp);
+}
+
+/* takes the text, or forgets it on error. nonzero then */
+static int keep_text(screen_row_t *row, const uint16_t *string, uint32_t size) {
+    if (size > row->allocd) {
+        uint16_t *text = realloc(row->text, size);
+        if (!text) {
+            row->size = 0;
+            return 1;
+        }
+        row->text = text;
+        row->allocd = size;
+    }
+    if (size)
+        memcpy(row->text, string, size);
+    row->size = size;
+    return 0;
+}
+
+int zhban_screen_update(zhban_t *zhban, zhban_screen_t *zscreen, const uint16_t **strings, const uint32_t *strsizes) {
+    screen_t *s = (screen_t *)zscreen;
+    uint32_t count = 0, shaped = 0, i, r;
+    int rv = 0;
+
+    /* what's different */
+    for (r = 0; r < zscreen->rows; r++) {
+        const uint32_t size = strsizes[r] & ~1u;
+        screen_row_t *row = s->row + r;
+        if (size == row->size && (!size || !memcmp(row->text, strings[r], size)))
+            continue;
+        s->changed[count++] = r;
+        if (size) {
+            s->strings[shaped] = strings[r];
+            s->strsizes[shaped++] = size;
+        }
+    }
+    if (shaped)
+        zhban_shape_batch(zhban, s->strings, s->strsizes, shaped, s->shapes);
+
+    /* redraw that */
+    zscreen->dirty_count = 0;
+    zscreen->rows_changed = count;
+    for (i = 0, shaped = 0; i < count; i++) {
+        r = s->changed[i];
+        screen_row_t *row = s->row + r;
+        const uint32_t size = strsizes[r] & ~1u;
+        zhban_shape_t *shape = size ? s->shapes[shaped++] : NULL;
+        zhban_rect_t rect = row_rect(zhban, zscreen, r);
+        int32_t extent = row->extent;
+
+        rect.w = row->extent;
+        clear_rect(zscreen, &rect);
+        if (row->shape)
+            zhban_release_shape(zhban, row->shape);
+        row->shape = NULL;
+        row->extent = 0;
+        rect.w = zscreen->w;
+
+        if (size && !shape) {
+            keep_text(row, NULL, 0);
+            rv = 1;
+        } else if (keep_text(row, strings[r], size)) {
+            zhban_release_shape(zhban, shape);
+            rv = 1;
+        } else if (shape) {
+            row->shape = shape;
+            row->extent = shape->w < zscreen->w ? shape->w : zscreen->w;
+            if (zhban_render_into(zhban, shape, zscreen->data, zscreen->w * format_bpp(zscreen->format), zscreen->format,
+                                    s->color, 0, rect.y + (int32_t)zhban->descent - shape->origin_y, &rect))
+                rv = 1;
+        }
+
+        /* cleared and drawn over, whichever is wider */
+        if (row->extent > extent)
+            extent = row->extent;
+        if (!extent)
+            continue;
+        zhban_rect_t *last = zscreen->dirty_count ? zscreen->dirty + zscreen->dirty_count - 1 : NULL;
+        if (last && last->y == rect.y + rect.h) {
+            last->y = rect.y;
+            last->h += rect.h;
+            if (extent > last->w)
+                last->w = extent;
+        } else {
+            rect.w = extent;
+            zscreen->dirty[zscreen->dirty_count++] = rect;
+        }
+    }
+    return rv;
+}
+
+void zhban_screen_drop(zhban_t *zhban, zhban_screen_t *zscreen) {
+    screen_t *s = (screen_t *)zscreen;
+
+    if (!s)
+        return;
+    if (s->row) {
+        for (uint32_t r = 0; r < zscreen->rows; r++) {
+            if (s->row[r].shape)
+                zhban_release_shape(zhban, s->row[r].shape);
+            free(s->row[r].text);
+        }
+    }
+    free(s->row);
+    free(s->changed);
+    free(s->strings);
+    free(s->strsizes);
+    free(s->shapes);
+    free(zscreen->dirty);
+    free(zscreen->data);
+    free(s);
+}
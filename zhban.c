@@ -20,12 +20,26 @@
     distribution.
 */
 
+#define _GNU_SOURCE     /* SCHED_IDLE */
+
 #include <stdio.h>
 #include <stdarg.h>
 #include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #include "zhban.h"
+#include "pool.h"
+#include "blit.h"
+#include "hash.h"
 
+#define HASH_FUNCTION(keyptr, keylen, hashv) ((hashv) = hash_fold(hash_bytes((keyptr), (keylen))))
 #include <uthash.h>
 #include <utlist.h>
 
@@ -39,17 +53,35 @@
 
 #if defined(USE_SDL2)
 #include "SDL.h"
-typedef SDL_atomic_t refcount_t;
-# define ZHBAN_INCREF(rc) (SDL_AtomicIncRef(&(rc)))
-# define ZHBAN_DECREF(rc) (SDL_AtomicDecRef(&(rc)))
-# define ZHBAN_GETREF(rc) (SDL_AtomicGet(&(rc)))
-#else
-typedef uint32_t refcount_t;
-# define ZHBAN_INCREF(rc) ((rc)+=1)
-# define ZHBAN_DECREF(rc) ((rc)-=1)
-# define ZHBAN_GETREF(rc) ((rc))
 #endif
 
+/*  Refcounts get incremented from zero only with the lock of the cache
+    the item is in held, so that whoever evicts under that lock sees it.
+    Decrements happen anywhere. DECREF returns the value before decrement.
+    Glyph and shape caches keep referenced items off the history list, which
+    thus holds only evictable ones: items are moved to the pinned list when
+    referenced from zero, and back when the last reference is dropped, which
+    is done under the lock too. See pin_*() and unref_*(). */
+typedef atomic_uint refcount_t;
+#define ZHBAN_INCREF(rc) (atomic_fetch_add_explicit(&(rc), 1, memory_order_relaxed))
+#define ZHBAN_DECREF(rc) (atomic_fetch_sub_explicit(&(rc), 1, memory_order_acq_rel))
+#define ZHBAN_GETREF(rc) (atomic_load_explicit(&(rc), memory_order_acquire))
+
+/* decrements unless it's the last reference, returns nonzero if it did */
+static inline int decref_not_last(refcount_t *rc) {
+    unsigned int v = atomic_load_explicit(rc, memory_order_relaxed);
+    while (v > 1)
+        if (atomic_compare_exchange_weak_explicit(rc, &v, v - 1, memory_order_acq_rel, memory_order_relaxed))
+            return 1;
+    return 0;
+}
+
+/* zhban_t statistics are plain integers for the sake of the bindings, thus no stdatomic here */
+#define ZHBAN_STAT_ADD(field, n) (__atomic_fetch_add(&(field), (n), __ATOMIC_RELAXED))
+#define ZHBAN_STAT_SUB(field, n) (__atomic_fetch_sub(&(field), (n), __ATOMIC_RELAXED))
+#define ZHBAN_STAT_GET(field)    (__atomic_load_n(&(field), __ATOMIC_RELAXED))
+#define ZHBAN_STAT_SET(field, v) (__atomic_store_n(&(field), (v), __ATOMIC_RELAXED))
+
 #if defined(__GNUC__) || defined(__clang__)
 # define ATTR_UNUSED __attribute__((unused))
 #else
@@ -63,10 +95,98 @@ typedef uint32_t refcount_t;
 typedef struct _shape shape_t;
 typedef struct _bitmap bitmap_t;
 typedef struct _glyph glyph_t;
-
-static void drop_shape_cache(shape_t **);
-static void drop_bitmap_cache(bitmap_t **);
-static void drop_glyph_cache(glyph_t **);
+typedef struct _atlas_page atlas_page_t;
+typedef struct _intern intern_t;
+typedef struct _prewarm_job prewarm_job_t;
+typedef struct _font_internal font_internal_t;
+
+/* replacement policy state of a cache, see the cache policy section */
+typedef struct _cache_policy {
+    uint32_t kind;              /* ZHBAN_CACHE_* */
+    uint32_t protected_size;    /* bytes on the protected list */
+    uint8_t *sketch;            /* TinyLFU request counts: SKETCH_ROWS rows of sketch_width saturating counters */
+    uint32_t sketch_width;      /* a power of two */
+    uint32_t sketch_adds;       /* counts get halved when this reaches SKETCH_AGE_FACTOR * sketch_width */
+} cache_policy_t;
+
+/* glyph cache is split by glyph id into this many independently locked parts */
+#define GLYPH_SHARDS 16
+
+/* subpixel phase slots per glyph id in the glyph table, see glyph_slot() */
+#define GLYPH_SLOTS_X 4
+#define GLYPH_SLOTS_Y 4
+
+typedef struct _glyph_shard {
+    pthread_mutex_t lock;       /* also guards glyph_table slots of its glyph ids */
+    glyph_t *overflow;  /* variants that don't have a glyph_table slot to themselves, see glyph_slot() */
+    glyph_t *history;   /* unreferenced glyphs on probation, least recently used first */
+    glyph_t *protected; /* unreferenced glyphs hit more than once, same order */
+    glyph_t *pinned;    /* referenced ones, in no particular order */
+    cache_policy_t policy;
+    uint32_t size;      /* bytes, same as zhban_t::glyph_size, but for this shard only */
+    uint32_t limit;
+} glyph_shard_t;
+
+/* where spanner() puts what FreeType gives it */
+typedef struct _raster_target {
+    glyph_t  *glyph;
+    uint32_t  tiled;        /* render into the tile, otherwise collect spans */
+    int32_t   x0, y0;       /* pixel position of the tile's bottom left corner */
+    uint32_t  w, h;
+    uint8_t  *tile;         /* w*h coverage, bottom row first. GLYPH_TILE_MAX_AREA bytes */
+} raster_target_t;
+
+/* primary face and fallbacks, see zhban_add_face() */
+#define MAX_FACES 8
+
+typedef struct _face_info {
+    font_internal_t    *font;       /* referenced */
+    uint32_t            glyph_base; /* glyph ids of this face are offset by this in the glyph cache */
+    FT_Size_RequestRec  size_request;
+} face_info_t;
+
+/* a piece of string shaped with one face, see split_runs() */
+typedef struct _face_run {
+    uint32_t start, end;    /* in UTF-16 units */
+    uint32_t face;
+} face_run_t;
+
+#define FACE_RUNS_MIN 16    /* allocated with the context, doubled as needed */
+
+/*  Everything a thread needs to shape strings and rasterize glyphs.
+    Contexts are pooled per zhban_t and created on demand, so that any number
+    of threads can call zhban_shape() at once. They share font data, caches,
+    and the FT_Library; faces and HarfBuzz objects are per context. */
+typedef struct _shaper_ctx {
+    FT_Face             ft_faces[MAX_FACES];
+    hb_font_t          *hb_fonts[MAX_FACES];
+    uint32_t            face_count; /* opened so far, catches up with zhban_internal_t's in acquire_ctx() */
+    FT_Error            ft_err;
+    FT_Raster_Params    ftr_params;
+    raster_target_t     raster;     /* ftr_params.user */
+    FT_Outline          outline;    /* a cached outline, scaled and translated, see scale_outline() */
+    uint32_t            outline_allocd; /* in points */
+    hb_buffer_t        *hb_buffer;
+
+    uint32_t           *batch_scratch;  /* zhban_shape_batch() bookkeeping */
+    uint32_t            batch_allocd;   /* in elements */
+    face_run_t         *runs;           /* split_runs() result */
+    uint32_t            runs_allocd;    /* in elements */
+
+    struct _shaper_ctx *next;   /* in the idle list */
+} shaper_ctx_t;
+
+typedef struct _zhban_internal zhban_internal_t;
+
+static void drop_shape_cache(zhban_internal_t *, shape_t **);
+static void flush_shape_cache(zhban_internal_t *);
+static void drop_bitmap_cache(zhban_internal_t *, bitmap_t **);
+static void drop_glyph_cache(zhban_internal_t *);
+static int map_glyph(zhban_internal_t *, glyph_t *);
+static void unmap_glyph_cache(zhban_internal_t *);
+static int find_shared_glyph(zhban_internal_t *, glyph_t *);
+static void share_glyph(zhban_internal_t *, glyph_t *);
+static void policy_setup(cache_policy_t *, uint32_t, uint32_t);
 static void spanner(int px_y, int count, const FT_Span* spans, void *user);
 
 typedef struct _zhban_internal {
@@ -74,48 +194,107 @@ typedef struct _zhban_internal {
 
     int32_t   log_level;
     zhban_logsink_t log_sink;
-    char log_buffer[LOG_BUFFER_LEN];
 
     uint32_t pixheight;
     uint32_t subpixel_positioning;  /* cache translated glyphs */
+    uint32_t phases_x, phases_y;    /* subpixel offsets snap to this many per pixel, see zhban_set_subpixel_phases() */
+    uint32_t word_cache;            /* compose lines out of cached words */
+
+    face_info_t         faces[MAX_FACES];   /* in priority order, the first one from zhban_open() */
+    uint32_t            face_count;
 
     FT_Library          ft_lib;
-    FT_Face             ft_face;
     FT_Error            ft_err;
-    FT_Raster_Params    ftr_params;
+    pthread_mutex_t     ft_lock;    /* serializes FT_New_Face()/FT_Done_Face() */
+
+    hb_segment_properties_t hb_props;   /* direction, script, language */
 
-    hb_font_t      *hb_font;
-    hb_buffer_t    *hb_buffer;
-    hb_direction_t  hb_direction;
-    hb_script_t     hb_script;
-    hb_language_t   hb_language;
+    /* idle shaping contexts */
+    shaper_ctx_t   *ctx_idle;
+    pthread_mutex_t ctx_lock;
 
     /* shaped strings cache */
+    pthread_mutex_t shaper_lock;
     shape_t *shaper_cache;
-    shape_t *shaper_history;
-
-    /* glyphs cache */
-    glyph_t *glyph_cache;
-    glyph_t *glyph_history;
+    shape_t *shaper_history;    /* unreferenced shapes on probation, least recently used first */
+    shape_t *shaper_protected;  /* unreferenced shapes hit more than once, same order */
+    shape_t *shaper_pinned;     /* referenced ones */
+    cache_policy_t shaper_policy;
+    uint32_t shaper_reserved;   /* bytes set aside for shapes being made by zhban_shape_batch() */
+
+    /* interned strings, see zhban_intern() */
+    pthread_mutex_t intern_lock;
+    intern_t *interned;
+
+    /* background prewarm jobs, see zhban_prewarm_codepoints() */
+    pthread_mutex_t warm_lock;
+    pthread_cond_t warm_cond;
+    pthread_cond_t warm_idle;   /* signalled when the queue runs out, see zhban_prewarm_wait() */
+    pthread_t warm_thread;
+    uint32_t warm_started;
+    uint32_t warm_busy;         /* a job is being done */
+    atomic_uint warm_quit;      /* read by prewarm loops without the lock */
+    prewarm_job_t *warm_jobs;
+
+    /* glyphs cache: glyph_slots slots per glyph id, one per subpixel phase, see glyph_slot() */
+    glyph_shard_t glyph_shards[GLYPH_SHARDS];
+    glyph_t **glyph_table;
+    uint32_t glyph_table_size;  /* the face's num_glyphs */
+    uint32_t glyph_slots;       /* 1 without subpixel positioning, else GLYPH_SLOTS_X * GLYPH_SLOTS_Y */
+
+    /* glyph cache file, see zhban_load_glyph_cache(). read-only once loaded */
+    void *map;
+    size_t map_size;
+
+    /* shared glyph store, see zhban_share_glyphs() */
+    void *store;
+    size_t store_size;
 
     /* below - used in render thread */
 
     /* bitmap cache */
     bitmap_t *bitmap_cache;
-    bitmap_t *bitmap_history;
+    bitmap_t *bitmap_history;   /* on probation, least recently used first */
+    bitmap_t *bitmap_protected; /* hit more than once, same order */
+    cache_policy_t bitmap_policy;
+
+    const blit_kernels_t *blit;     /* picked for the CPU at zhban_open() */
+
+    /* zhban_render_batch() workers and their work list */
+    pool_t *render_pool;
+    uint32_t render_threads;    /* as requested; 0 - one less than online CPUs */
+    bitmap_t **batch_items;
+    uint32_t batch_allocd;      /* in items */
+
+    /* glyph atlas, see zhban_atlas_setup() */
+    atlas_page_t *atlas_pages;
+    uint32_t atlas_page_count;
+    uint32_t atlas_max_pages;
+    uint32_t atlas_w, atlas_h;
+    uint32_t atlas_generation;  /* glyphs placed in earlier generations have to be placed again */
+    zhban_quads_t atlas_quads;  /* returned by zhban_render_quads() */
+    uint32_t atlas_quads_allocd;
 
 } zhban_internal_t;
 
+static void drop_atlas(zhban_internal_t *);
+static void drop_interned(zhban_internal_t *);
+static void stop_warmer(zhban_internal_t *);
+
 //{ logging
 
+/* buffer is on the stack: render workers log concurrently */
 static void logrintf(int msg_level, zhban_internal_t *z, const char *fmt, ...) {
     int written = 0;
     if (msg_level <= z->log_level) {
+        char log_buffer[LOG_BUFFER_LEN];
         va_list ap;
         va_start(ap, fmt);
-        written = vsnprintf(z->log_buffer, LOG_BUFFER_LEN, fmt, ap);
+        written = vsnprintf(log_buffer, LOG_BUFFER_LEN, fmt, ap);
         va_end(ap);
-        z->log_sink(msg_level, z->log_buffer, written);
+        if (written >= LOG_BUFFER_LEN)
+            written = LOG_BUFFER_LEN - 1;
+        z->log_sink(msg_level, log_buffer, written);
     }
     if (msg_level == ZHLOG_FATAL)
         abort();
@@ -133,6 +312,114 @@ static void logsink_stderr(const int level, const char *buf, const uint32_t len
     fprintf(stderr, "[%s] %s\n", log_level_name[level], buf);
 }
 
+//}
+//{ font
+/*  Font data and its glyph outlines, shared by all zhban_t opened with it, whatever their size.
+    Outlines are kept unhinted, in font units, and are scaled and translated for each glyph variant
+    rendered, instead of being loaded from the font every time. A slot per glyph id, filled once
+    and read without locking; past the limit, outlines are loaded and thrown away after use. */
+
+typedef struct _outline {
+    uint32_t n_points, n_contours;
+    int32_t  flags;
+    /* followed by n_points x, y pairs of int32_t, n_contours contour ends, n_points tags */
+} outline_t;
+
+#define OUTLINE_CONTOUR_SIZE sizeof(*((FT_Outline *)0)->contours)
+
+struct _font_internal {
+    zhban_font_t outer;
+
+    const void *data;
+    uint32_t size;
+    uint64_t hash;          /* hash_bytes() of the data */
+    refcount_t refs;        /* the caller's, and one per zhban_t face */
+
+    pthread_mutex_t lock;   /* guards setting up the below */
+    _Atomic(outline_t *) *outlines;
+    uint32_t num_glyphs;
+};
+
+static inline int32_t *outline_points(const outline_t *o) {
+    return (int32_t *)(o + 1);
+}
+
+static inline void *outline_contours(const outline_t *o) {
+    return outline_points(o) + 2 * o->n_points;
+}
+
+static inline void *outline_tags(const outline_t *o) {
+    return (char *)outline_contours(o) + o->n_contours * OUTLINE_CONTOUR_SIZE;
+}
+
+static inline uint32_t outline_sizeof(uint32_t n_points, uint32_t n_contours) {
+    return sizeof(outline_t) + n_points * (2 * sizeof(int32_t) + 1) + n_contours * OUTLINE_CONTOUR_SIZE;
+}
+
+zhban_font_t *zhban_font_open(const void *data, const uint32_t size, uint32_t outlinelimit) {
+    font_internal_t *font = malloc(sizeof(font_internal_t));
+
+    if (!font)
+        return NULL;
+    memset(font, 0, sizeof(font_internal_t));
+    font->outer.outline_limit = outlinelimit;
+    font->data = data;
+    font->size = size;
+    font->hash = hash_bytes(data, size);
+    atomic_init(&font->refs, 1);
+    pthread_mutex_init(&font->lock, NULL);
+    return (zhban_font_t *)font;
+}
+
+void zhban_font_drop(zhban_font_t *zfont) {
+    font_internal_t *font = (font_internal_t *) zfont;
+
+    if (!font || ZHBAN_DECREF(font->refs) != 1)
+        return;
+    if (font->outlines)
+        for (uint32_t i = 0; i < font->num_glyphs; i++)
+            free(atomic_load_explicit(font->outlines + i, memory_order_relaxed));
+    free(font->outlines);
+    pthread_mutex_destroy(&font->lock);
+    free(font);
+}
+
+/* sets up outline slots on first use by a zhban_t. nonzero on error */
+static int font_setup(font_internal_t *font, uint32_t num_glyphs) {
+    int rv = 0;
+
+    pthread_mutex_lock(&font->lock);
+    if (!font->outlines) {
+        if ((font->outlines = calloc(num_glyphs + 1, sizeof(*font->outlines))))
+            font->num_glyphs = num_glyphs;
+        else
+            rv = 1;
+    }
+    pthread_mutex_unlock(&font->lock);
+    return rv;
+}
+
+/* copies an outline loaded with FT_LOAD_NO_SCALE. NULL on error */
+static outline_t *make_outline(const FT_Outline *src) {
+    outline_t *o = malloc(outline_sizeof(src->n_points, src->n_contours));
+
+    if (!o)
+        return NULL;
+    o->n_points = src->n_points;
+    o->n_contours = src->n_contours;
+    o->flags = src->flags;
+    int32_t *points = outline_points(o);
+    for (uint32_t i = 0; i < o->n_points; i++) {
+        points[2 * i] = src->points[i].x;
+        points[2 * i + 1] = src->points[i].y;
+    }
+    if (o->n_points) {
+        memcpy(outline_contours(o), src->contours, o->n_contours * OUTLINE_CONTOUR_SIZE);
+        memcpy(outline_tags(o), src->tags, o->n_points);
+    }
+    return o;
+}
+
 //}
 
 static int force_ucs2_charmap(FT_Face ftf) {
@@ -145,17 +432,166 @@ static int force_ucs2_charmap(FT_Face ftf) {
     return -1;
 }
 
+static FT_Error open_face(zhban_internal_t *z, uint32_t index, FT_Face *face) {
+    FT_Error err;
+
+    pthread_mutex_lock(&z->ft_lock);
+    err = FT_New_Memory_Face(z->ft_lib, z->faces[index].font->data, z->faces[index].font->size, 0, face);
+    pthread_mutex_unlock(&z->ft_lock);
+    if (err)
+        return err;
+
+    if ((err = force_ucs2_charmap(*face))) {
+        pthread_mutex_lock(&z->ft_lock);
+        FT_Done_Face(*face);
+        pthread_mutex_unlock(&z->ft_lock);
+        *face = NULL;
+    }
+    return err;
+}
+
+static void drop_ctx(zhban_internal_t *z, shaper_ctx_t *ctx) {
+    free(ctx->batch_scratch);
+    free(ctx->runs);
+    free(ctx->raster.tile);
+    free(ctx->outline.points);
+    if (ctx->hb_buffer)
+        hb_buffer_destroy(ctx->hb_buffer);
+    for (uint32_t i = 0; i < MAX_FACES; i++) {
+        if (ctx->hb_fonts[i])
+            hb_font_destroy(ctx->hb_fonts[i]);
+        if (ctx->ft_faces[i]) {
+            pthread_mutex_lock(&z->ft_lock);
+            FT_Done_Face(ctx->ft_faces[i]);
+            pthread_mutex_unlock(&z->ft_lock);
+        }
+    }
+    free(ctx);
+}
+
+/* opens faces added since the context was created. nonzero on error */
+static int open_ctx_faces(zhban_internal_t *z, shaper_ctx_t *ctx) {
+    while (ctx->face_count < z->face_count) {
+        uint32_t i = ctx->face_count;
+        if (!ctx->ft_faces[i]) {
+            if ((ctx->ft_err = open_face(z, i, ctx->ft_faces + i)))
+                return 1;
+            if ((ctx->ft_err = FT_Request_Size(ctx->ft_faces[i], &z->faces[i].size_request)))
+                return 1;
+        }
+        /* initialize HB font here after font size is set (or ligatures go haywire) */
+        ctx->hb_fonts[i] = hb_ft_font_create(ctx->ft_faces[i], NULL);
+        ctx->face_count += 1;
+    }
+    return 0;
+}
+
+/* face - already sized face to take over, even on failure, or NULL to open a new one */
+static shaper_ctx_t *create_ctx(zhban_internal_t *z, FT_Face face) {
+    shaper_ctx_t *ctx = malloc(sizeof(shaper_ctx_t));
+    if (!ctx) {
+        log_error(z, "malloc() failed");
+        if (face) {
+            pthread_mutex_lock(&z->ft_lock);
+            FT_Done_Face(face);
+            pthread_mutex_unlock(&z->ft_lock);
+        }
+        return NULL;
+    }
+    memset(ctx, 0, sizeof(shaper_ctx_t));
+
+    ctx->ft_faces[0] = face;
+    if (open_ctx_faces(z, ctx))
+        goto error;
+    if (!(ctx->runs = malloc(FACE_RUNS_MIN * sizeof(face_run_t))))
+        goto error;
+    ctx->runs_allocd = FACE_RUNS_MIN;
+
+    ctx->ftr_params.target = 0;
+    ctx->ftr_params.flags = FT_RASTER_FLAG_DIRECT | FT_RASTER_FLAG_AA;
+    ctx->ftr_params.user = &ctx->raster;
+    ctx->ftr_params.black_spans = 0;
+    ctx->ftr_params.bit_set = 0;
+    ctx->ftr_params.bit_test = 0;
+    ctx->ftr_params.gray_spans = spanner;
+
+    ctx->hb_buffer = hb_buffer_create();
+    return ctx;
+
+    error:
+    log_error(z, "FT_Err=0x%02X", ctx->ft_err);
+    drop_ctx(z, ctx);
+    return NULL;
+}
+
+static shaper_ctx_t *acquire_ctx(zhban_internal_t *z) {
+    shaper_ctx_t *ctx;
+
+    pthread_mutex_lock(&z->ctx_lock);
+    ctx = z->ctx_idle;
+    if (ctx)
+        z->ctx_idle = ctx->next;
+    pthread_mutex_unlock(&z->ctx_lock);
+
+    if (!ctx) {
+        ctx = create_ctx(z, NULL);
+        log_trace(z, "new shaping context %p", ctx);
+    } else if (open_ctx_faces(z, ctx)) {
+        log_error(z, "FT_Err=0x%02X", ctx->ft_err);
+        drop_ctx(z, ctx);
+        ctx = NULL;
+    }
+    return ctx;
+}
+
+static void release_ctx(zhban_internal_t *z, shaper_ctx_t *ctx) {
+    pthread_mutex_lock(&z->ctx_lock);
+    ctx->next = z->ctx_idle;
+    z->ctx_idle = ctx;
+    pthread_mutex_unlock(&z->ctx_lock);
+}
+
 zhban_t *zhban_open(const void *data, const uint32_t datalen, uint32_t pixheight,
                                         uint32_t subpx,
                                         uint32_t glyphlimit, uint32_t shaperlimit, uint32_t renderlimit,
                                         int32_t loglevel, zhban_logsink_t logsink) {
+    zhban_font_t *font = zhban_font_open(data, datalen, ZHBAN_OUTLINE_LIMIT);
+    zhban_t *rv;
+
+    if (!font)
+        return NULL;
+    rv = zhban_open_font(font, pixheight, subpx, glyphlimit, shaperlimit, renderlimit, loglevel, logsink);
+    zhban_font_drop(font);  /* the zhban_t holds its own reference */
+    return rv;
+}
+
+zhban_t *zhban_open_font(zhban_font_t *font, uint32_t pixheight,
+                                        uint32_t subpx,
+                                        uint32_t glyphlimit, uint32_t shaperlimit, uint32_t renderlimit,
+                                        int32_t loglevel, zhban_logsink_t logsink) {
 
     zhban_internal_t *rv = malloc(sizeof(zhban_internal_t));
+    FT_Face face = NULL;
+    shaper_ctx_t *ctx;
     if (!rv)
         return NULL;
 
     memset(rv, 0, sizeof(zhban_internal_t));
     rv->outer.glyph_limit = glyphlimit;
+    for (int i = 0; i < GLYPH_SHARDS; i++) {
+        pthread_mutex_init(&rv->glyph_shards[i].lock, NULL);
+        rv->glyph_shards[i].limit = glyphlimit / GLYPH_SHARDS;
+    }
+    pthread_mutex_init(&rv->ft_lock, NULL);
+    pthread_mutex_init(&rv->ctx_lock, NULL);
+    pthread_mutex_init(&rv->shaper_lock, NULL);
+    pthread_mutex_init(&rv->intern_lock, NULL);
+    pthread_mutex_init(&rv->warm_lock, NULL);
+    pthread_cond_init(&rv->warm_cond, NULL);
+    pthread_cond_init(&rv->warm_idle, NULL);
+    rv->faces[0].font = (font_internal_t *) font;
+    ZHBAN_INCREF(rv->faces[0].font->refs);
+    rv->face_count = 1;
     rv->outer.shaper_limit = shaperlimit;
     rv->outer.bitmap_limit = renderlimit;
 
@@ -165,20 +601,9 @@ zhban_t *zhban_open(const void *data, const uint32_t datalen, uint32_t pixheight
     if ((rv->ft_err = FT_Init_FreeType(&rv->ft_lib)))
         goto error;
 
-    if ((rv->ft_err = FT_New_Memory_Face(rv->ft_lib, data, datalen, 0, &rv->ft_face)))
+    if ((rv->ft_err = open_face(rv, 0, &face)))
         goto error;
 
-    if ((rv->ft_err = force_ucs2_charmap(rv->ft_face)))
-        goto error;
-
-    rv->ftr_params.target = 0;
-    rv->ftr_params.flags = FT_RASTER_FLAG_DIRECT | FT_RASTER_FLAG_AA;
-    rv->ftr_params.user = NULL;
-    rv->ftr_params.black_spans = 0;
-    rv->ftr_params.bit_set = 0;
-    rv->ftr_params.bit_test = 0;
-    rv->ftr_params.gray_spans = spanner;
-
     FT_Size_RequestRec szreq;
     szreq.type = FT_SIZE_REQUEST_TYPE_SCALES; /* width and height are 16.16 scale values */
     szreq.horiResolution = szreq.vertResolution = 0; /* not used. */
@@ -196,9 +621,9 @@ zhban_t *zhban_open(const void *data, const uint32_t datalen, uint32_t pixheight
         in pixels that may not hold true. */
 
     log_trace(rv, "Font units: asc %08x dsc %08x h %08x delta %08x",
-            rv->ft_face->ascender, - rv->ft_face->descender,
-            rv->ft_face->height,
-            rv->ft_face->ascender - rv->ft_face->descender);
+            face->ascender, - face->descender,
+            face->height,
+            face->ascender - face->descender);
 
     uint32_t req_size = pixheight, got_size;
     /* to rely on
@@ -210,9 +635,9 @@ zhban_t *zhban_open(const void *data, const uint32_t datalen, uint32_t pixheight
     int foo;
     while(23) {
         szreq.width = ((req_size << 16) /
-            (rv->ft_face->ascender - rv->ft_face->descender + 1)) << 6;
+            (face->ascender - face->descender + 1)) << 6;
         szreq.height = szreq.width;
-        if ((rv->ft_err = FT_Request_Size(rv->ft_face, &szreq))) {
+        if ((rv->ft_err = FT_Request_Size(face, &szreq))) {
             /* error? hmm. keep trying */
             if (req_size > pixheight/2) {
                 req_size -= 1;
@@ -220,27 +645,27 @@ zhban_t *zhban_open(const void *data, const uint32_t datalen, uint32_t pixheight
             }
             goto error;
         }
-        got_size = (rv->ft_face->size->metrics.ascender
-                        - rv->ft_face->size->metrics.descender + 1) >> 6;
+        got_size = (face->size->metrics.ascender
+                        - face->size->metrics.descender + 1) >> 6;
 
         /* foo is got_size calculated other way around to see any rounding errors */
-        foo = (rv->ft_face->size->metrics.ascender >> 6);
-        foo -= (rv->ft_face->size->metrics.descender >> 6);
+        foo = (face->size->metrics.ascender >> 6);
+        foo -= (face->size->metrics.descender >> 6);
         foo += 1;
 
         if (foo > got_size)
             got_size = foo;
 
         log_trace(rv, "req_size=%d, got_size=%d (%d); h=%ld", req_size, got_size, foo,
-                                 rv->ft_face->size->metrics.height >> 6);
+                                 face->size->metrics.height >> 6);
         if (got_size <= pixheight)
             break;
         req_size -= 1;
     }
 #else
     while(42) {
-        szreq.width = szreq.height = ((req_size << 16) / (rv->ft_face->height)) << 6;
-        if ((rv->ft_err = FT_Request_Size(rv->ft_face, &szreq))) {
+        szreq.width = szreq.height = ((req_size << 16) / (face->height)) << 6;
+        if ((rv->ft_err = FT_Request_Size(face, &szreq))) {
             /* error? hmm. keep trying */
             if (req_size > pixheight/2) {
                 req_size -= 1;
@@ -248,80 +673,368 @@ zhban_t *zhban_open(const void *data, const uint32_t datalen, uint32_t pixheight
             }
             goto error;
         }
-        got_size = rv->ft_face->size->metrics.height >> 6;
+        got_size = face->size->metrics.height >> 6;
         log_trace(rv, "req_size=%d, got_size=%d", req_size, got_size);
         if (got_size <= pixheight)
             break;
         req_size -= 1;
     }
 #endif
+    rv->faces[0].size_request = szreq;
 
     rv->pixheight = pixheight;
     rv->subpixel_positioning = subpx;
+    rv->phases_x = rv->phases_y = 64;
 
-    rv->outer.em_width = rv->ft_face->size->metrics.x_ppem;
-    rv->outer.line_step = rv->ft_face->size->metrics.height >>6;
+    rv->outer.em_width = face->size->metrics.x_ppem;
+    rv->outer.line_step = face->size->metrics.height >>6;
+    rv->outer.descent = -(face->size->metrics.descender >> 6);
 
-   if ((rv->ft_err = FT_Load_Char(rv->ft_face, 0x0020u, 0))) {
+   if ((rv->ft_err = FT_Load_Char(face, 0x0020u, 0))) {
         log_error(rv, "FT_Load_Glyph(%08x): fterr=0x%02x", 0x0020u, rv->ft_err);
         goto error;
     }
 
-    rv->outer.space_advance = rv->ft_face->glyph->linearHoriAdvance>>16;
+    rv->outer.space_advance = face->glyph->linearHoriAdvance>>16;
+
+    if (font_setup(rv->faces[0].font, face->num_glyphs)) {
+        log_error(rv, "calloc() failed");
+        goto error;
+    }
+
+    rv->glyph_slots = subpx ? GLYPH_SLOTS_X * GLYPH_SLOTS_Y : 1;
+    if (!(rv->glyph_table = calloc((face->num_glyphs + 1) * rv->glyph_slots, sizeof(glyph_t *)))) {
+        log_error(rv, "calloc(%d) failed", (int)((face->num_glyphs + 1) * rv->glyph_slots * sizeof(glyph_t *)));
+        goto error;
+    }
+    rv->glyph_table_size = face->num_glyphs;
 
     log_info(rv, "accepted metrics: asc %d desc %d height %d em_width %d line_step %d "
                  "space_advance %d pixheight %d",
-            rv->ft_face->size->metrics.ascender >> 6,
-            rv->ft_face->size->metrics.descender >> 6,
-            rv->ft_face->size->metrics.height >> 6,
+            face->size->metrics.ascender >> 6,
+            face->size->metrics.descender >> 6,
+            face->size->metrics.height >> 6,
 
             rv->outer.em_width,
             rv->outer.line_step,
             rv->outer.space_advance,
             pixheight);
 
-    /* initialize HB font here after font size is set (or ligatures go haywire) */
-    rv->hb_font = hb_ft_font_create(rv->ft_face, NULL);
-    rv->hb_buffer = hb_buffer_create();
-    rv->hb_direction = HB_DIRECTION_LTR;
-    rv->hb_script = HB_SCRIPT_INVALID;
-    rv->hb_language = HB_LANGUAGE_INVALID;
+    rv->blit = blit_kernels();
+    log_info(rv, "using %s blit kernels", rv->blit->name);
+
+    rv->hb_props.direction = HB_DIRECTION_LTR;
+    rv->hb_props.script = HB_SCRIPT_INVALID;
+    rv->hb_props.language = HB_LANGUAGE_INVALID;
+
+    /* the face sized above becomes the first shaping context, which disposes of it if it fails */
+    ctx = create_ctx(rv, face);
+    face = NULL;
+    if (!ctx)
+        goto error;
+    release_ctx(rv, ctx);
 
     return (zhban_t *)rv;
 
     error:
     log_error(rv, "zhban_open(): FT_Err=0x%02X ", rv->ft_err);
+    if (face)
+        FT_Done_Face(face);
     zhban_drop((zhban_t *)rv);
-    free(rv);
     return NULL;
 }
 
 void zhban_set_script(zhban_t *zhban, const char *direction, const char *script, const char *language) {
     zhban_internal_t *z = (zhban_internal_t *) zhban;
 
-    z->hb_direction = hb_direction_from_string(direction, direction ? strlen(direction) : 0);
-    z->hb_script    = hb_script_from_string(script, script ? strlen(script) : 0);
-    z->hb_language  = hb_language_from_string(language, language ? strlen(language) : 0);
+    z->hb_props.direction = hb_direction_from_string(direction, direction ? strlen(direction) : 0);
+    z->hb_props.script    = hb_script_from_string(script, script ? strlen(script) : 0);
+    z->hb_props.language  = hb_language_from_string(language, language ? strlen(language) : 0);
+}
+
+void zhban_set_word_cache(zhban_t *zhban, uint32_t enable) {
+    zhban_internal_t *z = (zhban_internal_t *) zhban;
+
+    z->word_cache = enable;
+}
+
+int zhban_set_subpixel_phases(zhban_t *zhban, uint32_t x_phases, uint32_t y_phases) {
+    zhban_internal_t *z = (zhban_internal_t *) zhban;
+
+    if (x_phases < 1 || x_phases > 64 || y_phases < 1 || y_phases > 64) {
+        log_error(z, "phases %d, %d out of 1..64", x_phases, y_phases);
+        return 1;
+    }
+    if (x_phases == z->phases_x && y_phases == z->phases_y)
+        return 0;
+    /* glyphs and shapes made at the old phases would linger, mixed with the new ones */
+    if (z->map || z->store || ZHBAN_STAT_GET(z->outer.glyph_size)) {
+        log_error(z, "phases are to be set before anything is rendered, loaded or shared");
+        return 1;
+    }
+    z->phases_x = x_phases;
+    z->phases_y = y_phases;
+    return 0;
+}
+
+void zhban_set_outline_limit(zhban_t *zhban, uint32_t limit) {
+    zhban_internal_t *z = (zhban_internal_t *) zhban;
+
+    for (uint32_t i = 0; i < z->face_count; i++)
+        ZHBAN_STAT_SET(z->faces[i].font->outer.outline_limit, limit);
+}
+
+int zhban_add_face(zhban_t *zhban, const void *data, const uint32_t size) {
+    zhban_internal_t *z = (zhban_internal_t *) zhban;
+    zhban_font_t *font = zhban_font_open(data, size, ZHBAN_OUTLINE_LIMIT);
+    int rv;
+
+    if (!font) {
+        log_error(z, "malloc() failed");
+        return 1;
+    }
+    rv = zhban_add_font(zhban, font);
+    zhban_font_drop(font);
+    return rv;
+}
+
+int zhban_add_font(zhban_t *zhban, zhban_font_t *font) {
+    zhban_internal_t *z = (zhban_internal_t *) zhban;
+    face_info_t *fi = z->faces + z->face_count;
+    glyph_t **table;
+    FT_Face face;
+
+    if (z->face_count == MAX_FACES) {
+        log_error(z, "at most %d faces", MAX_FACES);
+        return 1;
+    }
+    if (z->map || z->store) {
+        log_error(z, "faces are to be added before loading or sharing glyphs");
+        return 1;
+    }
+    fi->font = (font_internal_t *) font;
+    /* same pixels per em as the primary face */
+    fi->size_request.type = FT_SIZE_REQUEST_TYPE_NOMINAL;
+    fi->size_request.width = fi->size_request.height = z->outer.em_width << 6;
+    fi->size_request.horiResolution = fi->size_request.vertResolution = 0;
+    if ((z->ft_err = open_face(z, z->face_count, &face)))
+        goto error;
+    if ((z->ft_err = FT_Request_Size(face, &fi->size_request))) {
+        pthread_mutex_lock(&z->ft_lock);
+        FT_Done_Face(face);
+        pthread_mutex_unlock(&z->ft_lock);
+        goto error;
+    }
+    fi->glyph_base = z->glyph_table_size;
+
+    /* the glyph cache gets a slot for each of the face's glyphs */
+    if (font_setup(fi->font, face->num_glyphs)
+        || !(table = realloc(z->glyph_table, (z->glyph_table_size + face->num_glyphs + 1) * z->glyph_slots * sizeof(glyph_t *)))) {
+        log_error(z, "out of memory");
+        pthread_mutex_lock(&z->ft_lock);
+        FT_Done_Face(face);
+        pthread_mutex_unlock(&z->ft_lock);
+        return 1;
+    }
+    memset(table + z->glyph_table_size * z->glyph_slots, 0, (face->num_glyphs + 1) * z->glyph_slots * sizeof(glyph_t *));
+    z->glyph_table = table;
+    z->glyph_table_size += face->num_glyphs;
+
+    log_info(z, "face %d: %d glyphs", z->face_count, (int)face->num_glyphs);
+    pthread_mutex_lock(&z->ft_lock);
+    FT_Done_Face(face);
+    pthread_mutex_unlock(&z->ft_lock);
+    /* contexts open it as they are next acquired */
+    ZHBAN_INCREF(fi->font->refs);
+    z->face_count += 1;
+    /* strings shaped with a missing glyph earlier may come out different now, words included */
+    flush_shape_cache(z);
+    return 0;
+
+    error:
+    log_error(z, "FT_Err=0x%02X", z->ft_err);
+    return 1;
 }
 
 void zhban_drop(zhban_t *zhban) {
     zhban_internal_t *z = (zhban_internal_t *) zhban;
 
-    if (z->hb_buffer)
-        hb_buffer_destroy(z->hb_buffer);
-    if (z->hb_font)
-        hb_font_destroy(z->hb_font);
-    if (z->ft_face)
-        FT_Done_Face(z->ft_face);
+    stop_warmer(z);     /* first, as it uses everything else */
+    pool_destroy(z->render_pool);
+    free(z->batch_items);
+    drop_atlas(z);
+    while (z->ctx_idle) {
+        shaper_ctx_t *ctx = z->ctx_idle;
+        z->ctx_idle = ctx->next;
+        drop_ctx(z, ctx);
+    }
     if (z->ft_lib)
         FT_Done_FreeType(z->ft_lib);
-    drop_bitmap_cache(&z->bitmap_cache); /* bitmaps first, as they reference shapes */
-    drop_shape_cache(&z->shaper_cache);  /* then shapes, as they reference glyphs */
-    drop_glyph_cache(&z->glyph_cache);
+    drop_bitmap_cache(z, &z->bitmap_cache); /* bitmaps first, as they reference shapes */
+    drop_shape_cache(z, &z->shaper_cache);  /* then shapes, as they reference glyphs */
+    drop_glyph_cache(z);
+    unmap_glyph_cache(z);   /* after the glyphs, as they might point into it */
+    if (z->store)
+        munmap(z->store, z->store_size);
+    drop_interned(z);
+    for (uint32_t i = 0; i < z->face_count; i++)
+        zhban_font_drop((zhban_font_t *)z->faces[i].font);
+    for (int i = 0; i < GLYPH_SHARDS; i++) {
+        pthread_mutex_destroy(&z->glyph_shards[i].lock);
+        policy_setup(&z->glyph_shards[i].policy, ZHBAN_CACHE_LRU, 0);
+    }
+    policy_setup(&z->shaper_policy, ZHBAN_CACHE_LRU, 0);
+    policy_setup(&z->bitmap_policy, ZHBAN_CACHE_LRU, 0);
+    pthread_mutex_destroy(&z->ft_lock);
+    pthread_mutex_destroy(&z->ctx_lock);
+    pthread_mutex_destroy(&z->shaper_lock);
+    pthread_mutex_destroy(&z->intern_lock);
+    pthread_mutex_destroy(&z->warm_lock);
+    pthread_cond_destroy(&z->warm_cond);
+    pthread_cond_destroy(&z->warm_idle);
 
     free(z);
 }
 
+//}
+//{ cache policy
+/*  Replacement policy, shared by the glyph, shape and bitmap caches.
+
+    Unreferenced items sit on one of two lists, least recently used first: probation, where
+    they start, and protected, where they go once hit again (SLRU). Protected ones over 4/5 of
+    the cache limit are demoted back to probation, and eviction takes probation items first,
+    so strings seen once, as in a log scrolled through, don't push out ones drawn every frame.
+    TinyLFU in addition counts requests in a small frequency sketch, and a new item that's been
+    asked for no more often than the next probation victim goes in front of it, to be evicted first.
+    Plain LRU keeps to the probation list.
+
+    The macros take list heads and the item sizing and key hash functions, so as to work for all
+    three item types, which have a segment field. Used with the cache's lock held. */
+
+#define CACHE_NEW           0   /* not put on either list yet */
+#define CACHE_PROBATION     1
+#define CACHE_PROTECTED     2
+#define CACHE_GONE          3   /* flushed while referenced, dropped with the last reference */
+
+#define SKETCH_ROWS         4
+#define SKETCH_MAX          15
+#define SKETCH_AGE_FACTOR   10
+
+/* (re)sets policy kind, dropping request counts. limit is that of the cache, sizes the sketch */
+static void policy_setup(cache_policy_t *p, uint32_t kind, uint32_t limit) {
+    free(p->sketch);
+    p->sketch = NULL;
+    p->sketch_width = 0;
+    p->sketch_adds = 0;
+    p->kind = kind;
+    if (kind == ZHBAN_CACHE_TINYLFU) {
+        /* a counter per 256 bytes of cache gives a few per item at any item size */
+        uint32_t width = 64;
+        while (width < limit / 256 && width < (1u << 16))
+            width <<= 1;
+        /* without the sketch it's SLRU, which is not worth failing over */
+        if ((p->sketch = calloc(SKETCH_ROWS, width)))
+            p->sketch_width = width;
+    }
+}
+
+static inline uint32_t sketch_index(const cache_policy_t *p, uint32_t hashv, uint32_t row) {
+    static const uint32_t seeds[SKETCH_ROWS] = { 0x9E3779B1u, 0x85EBCA6Bu, 0xC2B2AE35u, 0x27D4EB2Fu };
+    return row * p->sketch_width + (((hashv * seeds[row]) >> 15) & (p->sketch_width - 1));
+}
+
+/* counts a request for the key */
+static void policy_touch(cache_policy_t *p, uint32_t hashv) {
+    if (!p->sketch)
+        return;
+    for (uint32_t row = 0; row < SKETCH_ROWS; row++) {
+        uint8_t *counter = p->sketch + sketch_index(p, hashv, row);
+        if (*counter < SKETCH_MAX)
+            *counter += 1;
+    }
+    /* age the counts, so that what was popular once does not stay forever */
+    if (++p->sketch_adds >= SKETCH_AGE_FACTOR * p->sketch_width) {
+        for (uint32_t i = 0; i < SKETCH_ROWS * p->sketch_width; i++)
+            p->sketch[i] >>= 1;
+        p->sketch_adds = 0;
+    }
+}
+
+/* estimated recent request count for the key, 0 without the sketch */
+static uint32_t policy_frequency(const cache_policy_t *p, uint32_t hashv) {
+    uint32_t rv = SKETCH_MAX;
+    if (!p->sketch)
+        return 0;
+    for (uint32_t row = 0; row < SKETCH_ROWS; row++) {
+        uint32_t counter = p->sketch[sketch_index(p, hashv, row)];
+        rv = counter < rv ? counter : rv;
+    }
+    return rv;
+}
+
+/* takes an item off whichever list it is on */
+#define CACHE_UNLINK(p, probation, protected, item, sizeof_fn) do {                     \
+        if ((item)->segment == CACHE_PROTECTED) {                                       \
+            DL_DELETE(protected, item);                                                 \
+            (p)->protected_size -= sizeof_fn(item);                                     \
+        } else {                                                                        \
+            DL_DELETE(probation, item);                                                 \
+        }                                                                               \
+    } while (0)
+
+/* moves least recently used protected items to probation until there are at most cap bytes of them */
+#define CACHE_DEMOTE(p, probation, protected, sizeof_fn, cap) do {                      \
+        while ((p)->protected_size > (cap) && (protected)) {                            \
+            LDECLTYPE(protected) _demoted = (protected);                                \
+            DL_DELETE(protected, _demoted);                                             \
+            (p)->protected_size -= sizeof_fn(_demoted);                                 \
+            _demoted->segment = CACHE_PROBATION;                                        \
+            DL_APPEND(probation, _demoted);                                             \
+        }                                                                               \
+    } while (0)
+
+/* the item got requested again */
+#define CACHE_HIT(z, p, item) do {                                                      \
+        if ((p)->kind != ZHBAN_CACHE_LRU && (item)->segment != CACHE_PROTECTED) {       \
+            (item)->segment = CACHE_PROTECTED;                                          \
+            ZHBAN_STAT_ADD((z)->outer.cache_promotions, 1);                             \
+        }                                                                               \
+    } while (0)
+
+/* puts an unreferenced item at the tail of its list, or a new one in front of the next victim, see above */
+#define CACHE_PUT(z, p, probation, protected, item, sizeof_fn, hashv_fn, limit) do {    \
+        if ((item)->segment == CACHE_PROTECTED && (p)->kind != ZHBAN_CACHE_LRU) {       \
+            DL_APPEND(protected, item);                                                 \
+            (p)->protected_size += sizeof_fn(item);                                     \
+            CACHE_DEMOTE(p, probation, protected, sizeof_fn, (limit) / 5 * 4);          \
+        } else if ((item)->segment == CACHE_NEW && (p)->sketch && (probation) &&         \
+                policy_frequency(p, hashv_fn(item)) <= policy_frequency(p, hashv_fn(probation))) { \
+            (item)->segment = CACHE_PROBATION;                                          \
+            DL_PREPEND(probation, item);                                                \
+            ZHBAN_STAT_ADD((z)->outer.cache_rejections, 1);                             \
+        } else {                                                                        \
+            (item)->segment = CACHE_PROBATION;                                          \
+            DL_APPEND(probation, item);                                                 \
+        }                                                                               \
+    } while (0)
+
+/* puts an item that was just hit at the tail of its list. unlike CACHE_PUT() it never asks the
+   sketch, the lookup has counted the request already */
+#define CACHE_REQUEUE(z, p, probation, protected, item, sizeof_fn, limit) do {           \
+        CACHE_UNLINK(p, probation, protected, item, sizeof_fn);                         \
+        CACHE_HIT(z, p, item);                                                          \
+        if ((item)->segment == CACHE_PROTECTED) {                                       \
+            DL_APPEND(protected, item);                                                 \
+            (p)->protected_size += sizeof_fn(item);                                     \
+            CACHE_DEMOTE(p, probation, protected, sizeof_fn, (limit) / 5 * 4);          \
+        } else {                                                                        \
+            DL_APPEND(probation, item);                                                 \
+        }                                                                               \
+    } while (0)
+
+/* the item to evict next, if any */
+#define CACHE_VICTIM(probation, protected) ((probation) ? (probation) : (protected))
+
 //}
 //{ glyph_t
 typedef struct _span {
@@ -342,53 +1055,107 @@ struct _glyph {
     int32_t min_y;
     int32_t max_y;
 
-    uint32_t  spans_used;   /* bytes */
-    uint32_t  spans_allocd; /* bytes */
-    span_t   *spans;
+    /* rendered glyph, either as spans or as a dense tile of 8-bit coverage
+       (max_span_x - min_span_x) by (max_y - min_y + 1) pixels, bottom row first. see render_glyph() */
+    uint32_t  tiled;
+    uint32_t  data_used;    /* bytes */
+    uint32_t  data_allocd;  /* bytes */
+    void     *data;
 
-    uint32_t  refcount;
+    refcount_t refcount;    /* shapes referencing this glyph. zero if on a shard history list */
+    uint32_t   segment;     /* CACHE_*, under the shard lock */
+    uint32_t   hashv;       /* of the key, for the frequency sketch. see glyph_hash() */
+    uint32_t   mapped;      /* data points into the glyph cache file or the shared store, data_allocd is 0 */
 
-    UT_hash_handle hh;
+    /* atlas placement, render thread only. valid if atlas_generation matches zhban_internal_t's one */
+    uint32_t  atlas_generation;
+    uint32_t  atlas_page;
+    uint32_t  atlas_x, atlas_y;
+
+    UT_hash_handle hh;      /* in the shard overflow table, if not in its glyph_table slot */
     struct _glyph *prev;
     struct _glyph *next;
 };
 
+/* glyphs with a pixel bounding box of at most this many pixels are stored as tiles:
+   at text sizes a tile is both smaller than spans (8 bytes each, a few per row) and cheaper to blit */
+#define GLYPH_TILE_MAX_AREA 1024
+
+static inline span_t *glyph_spans(const glyph_t *glyph) {
+    return (span_t *)glyph->data;
+}
+
+static inline uint32_t glyph_span_count(const glyph_t *glyph) {
+    return glyph->tiled ? 0 : glyph->data_used / sizeof(span_t);
+}
+
+static inline uint8_t *glyph_tile(const glyph_t *glyph) {
+    return (uint8_t *)glyph->data;
+}
+
+static inline uint32_t glyph_tile_w(const glyph_t *glyph) {
+    return glyph->max_span_x - glyph->min_span_x;
+}
+
+static inline uint32_t glyph_tile_h(const glyph_t *glyph) {
+    return glyph->max_y - glyph->min_y + 1;
+}
+
 static void add_glyph_spans(glyph_t *dst, const int32_t y, const FT_Span *spans, const uint32_t count) {
     const uint32_t required_bytes = count * sizeof(span_t);
-    if (dst->spans_allocd - dst->spans_used < required_bytes ) {
-        dst->spans_allocd += required_bytes;
-        dst->spans = realloc(dst->spans, dst->spans_allocd);
+    if (dst->data_allocd - dst->data_used < required_bytes ) {
+        /* grow geometrically, spanner() gets called once per row */
+        dst->data_allocd += dst->data_allocd / 2 > required_bytes ? dst->data_allocd / 2 : required_bytes;
+        dst->data = realloc(dst->data, dst->data_allocd);
     }
     for (uint32_t i = 0; i < count ; i++) {
-        span_t *s = dst->spans + dst->spans_used/sizeof(span_t) + i;
+        /* zero coverage spans do happen. skip them, same as tiles do */
+        if (!spans[i].coverage)
+            continue;
+        span_t *s = glyph_spans(dst) + dst->data_used/sizeof(span_t);
         s->len = spans[i].len;
         s->x = spans[i].x;
         s->y = y;
         s->coverage = (spans[i].coverage << 8) | spans[i].coverage;
+        dst->data_used += sizeof(span_t);
     }
-    dst->spans_used += required_bytes;
 }
 
 static void drop_glyph(glyph_t *g) {
-    free(g->spans);
+    if (!g->mapped)
+        free(g->data);
     free(g);
 }
 
-static void drop_glyph_cache(glyph_t **head) {
+static void drop_glyph_cache(zhban_internal_t *z) {
     glyph_t *elt, *tmp;
-    HASH_ITER(hh, *head, elt, tmp) {
-        HASH_DEL(*head, elt);
-        drop_glyph(elt);
+
+    for (uint32_t i = 0; i < z->glyph_table_size * z->glyph_slots; i++)
+        if (z->glyph_table[i])
+            drop_glyph(z->glyph_table[i]);
+    for (int i = 0; i < GLYPH_SHARDS; i++) {
+        HASH_ITER(hh, z->glyph_shards[i].overflow, elt, tmp) {
+            HASH_DEL(z->glyph_shards[i].overflow, elt);
+            drop_glyph(elt);
+        }
+        z->glyph_shards[i].history = z->glyph_shards[i].protected = z->glyph_shards[i].pinned = NULL;
     }
+    free(z->glyph_table);
+    z->glyph_table = NULL;
+}
+
+static inline uint32_t glyph_hashv(const glyph_t *glyph) {
+    return glyph->hashv;
 }
 
 static inline uint32_t glyph_sizeof(glyph_t *glyph) {
-    return sizeof(glyph_t) + glyph->spans_allocd;
+    return sizeof(glyph_t) + glyph->data_allocd;
 }
 
 static inline uint32_t glyph_expected_spans(zhban_internal_t *z) {
-    return (z->outer.glyph_spans_seen ? z->outer.glyph_spans_seen : 1) /
-           (z->outer.glyph_gets ? z->outer.glyph_gets : 1)  + 1;
+    uint32_t spans_seen = ZHBAN_STAT_GET(z->outer.glyph_spans_seen);
+    uint32_t gets = ZHBAN_STAT_GET(z->outer.glyph_gets);
+    return (spans_seen ? spans_seen : 1) / (gets ? gets : 1)  + 1;
 }
 static inline uint32_t glyph_expected_sizeof(zhban_internal_t *z) {
     return sizeof(glyph_t) + sizeof(span_t) * glyph_expected_spans(z);
@@ -399,65 +1166,99 @@ static glyph_t *reallocate_glyph(zhban_internal_t *z, glyph_t *glyph) {
         glyph = malloc(sizeof(glyph_t));
         memset(glyph, 0, sizeof(glyph_t));
     }
-    if (glyph->spans_allocd < sizeof(span_t) * glyph_expected_spans(z)) {
-        glyph->spans_allocd = sizeof(span_t) * glyph_expected_spans(z);
-        glyph->spans = malloc(glyph->spans_allocd);
+    if (glyph->mapped) {
+        glyph->data = NULL;
+        glyph->mapped = 0;
+    }
+    if (glyph->data_allocd < sizeof(span_t) * glyph_expected_spans(z)) {
+        glyph->data_allocd = sizeof(span_t) * glyph_expected_spans(z);
+        glyph->data = realloc(glyph->data, glyph->data_allocd);
     }
     return glyph;
 }
 
-static glyph_t *get_idle_glyph(zhban_internal_t *z) {
-    glyph_t *item, *evicted_item = NULL, *tmp;
-    uint32_t needed_space = glyph_expected_sizeof(z);
-    log_trace(z, "need %d have %d (%d - %d)", needed_space,
-            z->outer.glyph_limit - z->outer.glyph_size, z->outer.glyph_limit, z->outer.glyph_size);
+/* all variants of a glyph are in the same shard, so that its glyph_table slot is under one lock */
+static inline glyph_shard_t *glyph_shard(zhban_internal_t *z, uint32_t codepoint) {
+    return z->glyph_shards + codepoint % GLYPH_SHARDS;
+}
 
-    /* if we are over the cache size limit, clean up some. */
-    DL_FOREACH_SAFE(z->glyph_history, item, tmp) {
-        /* ignore referenced ones */
-        if (item->refcount)
-            continue;
+static inline uint32_t glyph_hash(uint32_t codepoint, int32_t frac_x, int32_t frac_y) {
+    return (codepoint * 0x9E3779B1u) ^ ((uint32_t)(frac_x << 6 | frac_y) * 0x85EBCA6Bu);
+}
 
-        /* if we have enough space at last .. */
-        if (needed_space < (z->outer.glyph_limit - z->outer.glyph_size)) {
-            if (evicted_item)
-                /* got it by eviction, reuse item so as to not do free/alloc dance */
-                item = evicted_item;
-            else
-                /* just have free space here; reallocate_shape() will allocate new item */
-                item = NULL;
-            break;
-        }
+/* glyph_table slot for a variant. fractions are quantized to a fixed small grid, so with up to that many
+   phases each variant gets a slot of its own; with more, the first variant in a slot takes it, and the rest
+   go to the shard overflow table, keyed by the codepoint and fraction, as there's no telling how many there
+   will be. depends on the key alone, never on settings that can change while the glyph is cached */
+static inline glyph_t **glyph_slot(zhban_internal_t *z, uint32_t codepoint, int32_t frac_x, int32_t frac_y) {
+    if (z->glyph_slots == 1)
+        return z->glyph_table + codepoint;
+    const uint32_t sx = (((uint32_t)frac_x * GLYPH_SLOTS_X + 32) >> 6) % GLYPH_SLOTS_X;
+    const uint32_t sy = (((uint32_t)frac_y * GLYPH_SLOTS_Y + 32) >> 6) % GLYPH_SLOTS_Y;
+    return z->glyph_table + codepoint * z->glyph_slots + sx * GLYPH_SLOTS_Y + sy;
+}
+
+#define GLYPH_KEY_SIZE (3 * sizeof(int32_t))    /* codepoint, frac_x, frac_y */
+
+/* called with the shard lock held */
+static void unlink_glyph(zhban_internal_t *z, glyph_shard_t *shard, glyph_t *item) {
+    glyph_t **slot = glyph_slot(z, item->codepoint, item->frac_x, item->frac_y);
+    if (*slot == item)
+        *slot = NULL;
+    else
+        HASH_DELETE(hh, shard->overflow, item);
+}
+
+/* called with the shard lock held */
+static void link_glyph(zhban_internal_t *z, glyph_shard_t *shard, glyph_t *item) {
+    glyph_t **slot = glyph_slot(z, item->codepoint, item->frac_x, item->frac_y);
+    if (!*slot)
+        *slot = item;
+    else
+        HASH_ADD_KEYPTR_BYHASHVALUE(hh, shard->overflow, &item->codepoint, GLYPH_KEY_SIZE, item->hashv, item);
+}
+
+/* called with shard->lock held. returned item is not in the shard, its storage is not touched. */
+static glyph_t *get_idle_glyph(zhban_internal_t *z, glyph_shard_t *shard) {
+    glyph_t *item, *evicted_item = NULL;
+    uint32_t needed_space = glyph_expected_sizeof(z);
+    log_trace(z, "need %d have %d (%d - %d)", needed_space,
+            shard->limit - shard->size, shard->limit, shard->size);
 
+    /* if we are over the cache size limit, clean up some. everything on the history list is unreferenced. */
+    while ((item = CACHE_VICTIM(shard->history, shard->protected)) && shard->size + needed_space >= shard->limit) {
         /* drop evicted item if we need to evict more that one */
         if (evicted_item)
             drop_glyph(evicted_item);
 
-        HASH_DELETE(hh, z->glyph_cache, item);
-        DL_DELETE(z->glyph_history, item);
-        z->outer.glyph_size -= glyph_sizeof(item);
-        z->outer.glyph_evictions += 1;
+        unlink_glyph(z, shard, item);
+        CACHE_UNLINK(&shard->policy, shard->history, shard->protected, item, glyph_sizeof);
+        shard->size -= glyph_sizeof(item);
+        ZHBAN_STAT_SUB(z->outer.glyph_size, glyph_sizeof(item));
+        ZHBAN_STAT_ADD(z->outer.glyph_evictions, 1);
         evicted_item = item;
     }
 
-    /* end up here with either an item to be reused (storage not touched),
-       or with item == NULL, in case either there's space in the cache to use,
+    /* end up here with either an evicted item to be reused (storage not touched),
+       or with NULL, in case either there's space in the cache to use,
        or we failed to free up space in the cache (like, too much shapes with
        refcount > 0), in which case we ignore the cache size limit. */
 
-    glyph_t *rv = reallocate_glyph(z, item);
+    glyph_t *rv = reallocate_glyph(z, evicted_item);
 
     /* grow cache to avoid thrashing (?) */
-    if (z->outer.glyph_limit < z->outer.glyph_size) {
-        log_trace(z, "grew glyph cache from %d to %d", z->outer.glyph_limit, z->outer.glyph_size);
-        z->outer.glyph_limit = z->outer.glyph_size;
+    if (shard->limit < shard->size) {
+        log_trace(z, "grew glyph cache shard from %d to %d", shard->limit, shard->size);
+        ZHBAN_STAT_ADD(z->outer.glyph_limit, shard->size - shard->limit);
+        shard->limit = shard->size;
     }
 
     return rv;
 }
 
 static void spanner(int y, int count, const FT_Span* spans, void *user) {
-    glyph_t *glyph = (glyph_t *) user;
+    raster_target_t *rt = (raster_target_t *) user;
+    glyph_t *glyph = rt->glyph;
 
     if (y < glyph->min_y)
         glyph->min_y = y;
@@ -472,110 +1273,798 @@ static void spanner(int y, int count, const FT_Span* spans, void *user) {
         if (min_x < glyph->min_span_x)
             glyph->min_span_x = min_x;
     }
-    add_glyph_spans(glyph, y, spans, count);
+    if (rt->tiled) {
+        uint8_t *row = rt->tile + (y - rt->y0) * rt->w - rt->x0;
+        for (int i = 0; i < count; i++)
+            memset(row + spans[i].x, spans[i].coverage, spans[i].len);
+    } else {
+        add_glyph_spans(glyph, y, spans, count);
+    }
 }
-/* returns nonzero on error */
-static int render_glyph(zhban_internal_t *z, glyph_t *glyph) {
-   if ((z->ft_err = FT_Load_Glyph(z->ft_face, glyph->codepoint, 0))) {
-        log_error(z, "FT_Load_Glyph(%08x): fterr=0x%02x", glyph->codepoint, z->ft_err);
-        return 1;
+
+/* sets up the raster target for a glyph: a tile covering the outline's control box if it's small enough */
+static void setup_raster_target(raster_target_t *rt, glyph_t *glyph, FT_Outline *outline) {
+    FT_BBox cbox;
+
+    FT_Outline_Get_CBox(outline, &cbox);
+    rt->glyph = glyph;
+    rt->x0 = cbox.xMin >> 6;
+    rt->y0 = cbox.yMin >> 6;
+    rt->w = ((cbox.xMax + 63) >> 6) - rt->x0;
+    rt->h = ((cbox.yMax + 63) >> 6) - rt->y0;
+
+    rt->tiled = outline->n_points > 0 && rt->w * rt->h <= GLYPH_TILE_MAX_AREA;
+    if (!rt->tiled)
+        return;
+    if (!rt->tile && !(rt->tile = malloc(GLYPH_TILE_MAX_AREA))) {
+        rt->tiled = 0;
+        return;
     }
-    if (z->ft_face->glyph->format != FT_GLYPH_FORMAT_OUTLINE) {
-        log_error(z, "unexpected glyph->format = %4s", (char *)&z->ft_face->glyph->format);
-        return 1;
+    memset(rt->tile, 0, rt->w * rt->h);
+}
+
+/* copies what got rendered into the tile, trimmed to the actual extents */
+static void store_tile(raster_target_t *rt, glyph_t *glyph) {
+    if (glyph->min_span_x == INT_MAX) {
+        /* nothing got rendered after all */
+        glyph->tiled = 0;
+        return;
+    }
+
+    const uint32_t w = glyph_tile_w(glyph), h = glyph_tile_h(glyph);
+    if (glyph->data_allocd < w * h) {
+        glyph->data_allocd = w * h;
+        glyph->data = realloc(glyph->data, glyph->data_allocd);
+    }
+
+    const uint8_t *src = rt->tile + (glyph->min_y - rt->y0) * rt->w + glyph->min_span_x - rt->x0;
+    for (uint32_t row = 0; row < h; row++)
+        memcpy(glyph_tile(glyph) + row * w, src + row * rt->w, w);
+    glyph->tiled = 1;
+    glyph->data_used = w * h;
+}
+/* which face a glyph cache glyph id is of */
+static inline uint32_t glyph_face(const zhban_internal_t *z, uint32_t codepoint) {
+    uint32_t f = z->face_count - 1;
+    while (f && codepoint < z->faces[f].glyph_base)
+        f--;
+    return f;
+}
+
+/*  returns the font's outline of a glyph, loading it if it is not there yet. if the font is over
+    its outline limit, the outline is returned in *owned, to be freed after use. NULL if the glyph
+    has no outline, or on error. */
+static const outline_t *get_outline(shaper_ctx_t *ctx, font_internal_t *font, FT_Face face, uint32_t gid,
+                                                                                    outline_t **owned) {
+    outline_t *rv;
+
+    ZHBAN_STAT_ADD(font->outer.outline_gets, 1);
+    if (gid < font->num_glyphs && (rv = atomic_load_explicit(font->outlines + gid, memory_order_acquire))) {
+        ZHBAN_STAT_ADD(font->outer.outline_hits, 1);
+        return rv;
+    }
+    if ((ctx->ft_err = FT_Load_Glyph(face, gid, FT_LOAD_NO_SCALE)))
+        return NULL;
+    if (face->glyph->format != FT_GLYPH_FORMAT_OUTLINE || !(rv = make_outline(&face->glyph->outline)))
+        return NULL;
+
+    const uint32_t size = outline_sizeof(rv->n_points, rv->n_contours);
+    if (gid < font->num_glyphs
+            && ZHBAN_STAT_ADD(font->outer.outline_size, size) + size <= ZHBAN_STAT_GET(font->outer.outline_limit)) {
+        outline_t *expected = NULL;
+        if (atomic_compare_exchange_strong_explicit(font->outlines + gid, &expected, rv,
+                                                    memory_order_acq_rel, memory_order_acquire))
+            return rv;
+        /* another thread got there first */
+        ZHBAN_STAT_SUB(font->outer.outline_size, size);
+        free(rv);
+        return expected;
+    }
+    if (gid < font->num_glyphs)
+        ZHBAN_STAT_SUB(font->outer.outline_size, size);
+    *owned = rv;
+    return rv;
+}
+
+/* scales an outline from font units to the face's size, and translates it, into ctx->outline. NULL on error */
+static FT_Outline *scale_outline(shaper_ctx_t *ctx, const outline_t *o, FT_Face face, int32_t dx, int32_t dy) {
+    const FT_Fixed x_scale = face->size->metrics.x_scale, y_scale = face->size->metrics.y_scale;
+    const int32_t *src = outline_points(o);
+    FT_Outline *rv = &ctx->outline;
+
+    if (ctx->outline_allocd < o->n_points) {
+        FT_Vector *points = realloc(rv->points, o->n_points * sizeof(FT_Vector));
+        if (!points)
+            return NULL;
+        rv->points = points;
+        ctx->outline_allocd = o->n_points;
+    }
+    for (uint32_t i = 0; i < o->n_points; i++) {
+        rv->points[i].x = FT_MulFix(src[2 * i], x_scale) + dx;
+        rv->points[i].y = FT_MulFix(src[2 * i + 1], y_scale) + dy;
+    }
+    /* read-only to the rasterizer */
+    rv->tags = outline_tags(o);
+    rv->contours = outline_contours(o);
+    rv->n_points = o->n_points;
+    rv->n_contours = o->n_contours;
+    rv->flags = o->flags;
+    return rv;
+}
+
+/*  with subpixel positioning, glyphs are rendered unhinted out of the font's outline cache.
+    otherwise each glyph is rendered once, so it's loaded hinted at the size as is.
+    returns nonzero on error */
+static int render_glyph(zhban_internal_t *z, shaper_ctx_t *ctx, glyph_t *glyph) {
+    const uint32_t f = glyph_face(z, glyph->codepoint);
+    const uint32_t gid = glyph->codepoint - z->faces[f].glyph_base;
+    FT_Face face = ctx->ft_faces[f];
+    FT_Outline *outline = NULL;
+    outline_t *owned = NULL;
+    const outline_t *cached;
+
+    if (z->subpixel_positioning && (cached = get_outline(ctx, z->faces[f].font, face, gid, &owned)))
+        outline = scale_outline(ctx, cached, face, glyph->frac_x, glyph->frac_y);
+
+    if (!outline) {
+        if ((ctx->ft_err = FT_Load_Glyph(face, gid, 0))) {
+            log_error(z, "FT_Load_Glyph(%08x): fterr=0x%02x", glyph->codepoint, ctx->ft_err);
+            goto error;
+        }
+        if (face->glyph->format != FT_GLYPH_FORMAT_OUTLINE) {
+            log_error(z, "unexpected glyph->format = %4s", (char *)&face->glyph->format);
+            goto error;
+        }
+        /* translate by the fractional part of the offset
+           not putting if (z->subpixel_positioning) here since FT_Outline_Translate()
+           is supposed to be cheap. */
+        outline = &face->glyph->outline;
+        FT_Outline_Translate(outline, glyph->frac_x, glyph->frac_y);
     }
-    /* translate by the fractional part of the offset
-       not putting if (z->subpixel_positioning) here since FT_Outline_Translate()
-       is supposed to be cheap. */
-    FT_Outline_Translate(&z->ft_face->glyph->outline, glyph->frac_x, glyph->frac_y);
 
     glyph->min_span_x = INT_MAX;
     glyph->max_span_x = INT_MIN;
     glyph->min_y = INT_MAX;
     glyph->max_y = INT_MIN;
-    glyph->spans_used = 0;
+    glyph->data_used = 0;
+    glyph->tiled = 0;
+    glyph->atlas_generation = 0;
 
-    z->ftr_params.user = glyph;
+    setup_raster_target(&ctx->raster, glyph, outline);
 
-    if ((z->ft_err = FT_Outline_Render(z->ft_lib, &z->ft_face->glyph->outline, &z->ftr_params))) {
-        log_error(z, "FT_Outline_Render() fterr=0x%02x", z->ft_err);
+    if ((ctx->ft_err = FT_Outline_Render(z->ft_lib, outline, &ctx->ftr_params))) {
+        log_error(z, "FT_Outline_Render() fterr=0x%02x", ctx->ft_err);
         goto error;
     }
 
-    z->outer.glyph_rendered += 1;
-    z->outer.glyph_spans_seen += glyph->spans_used/sizeof(span_t);
+    if (ctx->raster.tiled)
+        store_tile(&ctx->raster, glyph);
+
+    ZHBAN_STAT_ADD(z->outer.glyph_rendered, 1);
+    ZHBAN_STAT_ADD(z->outer.glyph_spans_seen, glyph_span_count(glyph));
 
-    FT_Outline_Translate(&z->ft_face->glyph->outline, -glyph->frac_x, -glyph->frac_y);
+    if (outline == &face->glyph->outline)
+        FT_Outline_Translate(outline, -glyph->frac_x, -glyph->frac_y);
+    free(owned);
 
-    log_trace(z, "cp %x %d spans frac_xy %d, %d, minmax_x %d, %d", glyph->codepoint,
-        glyph->spans_used/sizeof(span_t),
+    log_trace(z, "cp %x %s %d bytes frac_xy %d, %d, minmax_x %d, %d", glyph->codepoint,
+        glyph->tiled ? "tile" : "spans", glyph->data_used,
         glyph->frac_x, glyph->frac_y, glyph->min_span_x, glyph->max_span_x);
 
     return 0;
 error:
+    free(owned);
     return 1;
 }
 
-static glyph_t *get_a_glyph(zhban_internal_t *z, uint32_t codepoint, int32_t frac_x, int32_t frac_y) {
-    glyph_t *item;
-    const size_t keylen = 3 * sizeof(int32_t);
+/* called with shard->lock held. takes a reference, moving the glyph off the history list if it was there */
+static void pin_glyph(glyph_shard_t *shard, glyph_t *item) {
+    if (ZHBAN_INCREF(item->refcount) == 0) {
+        CACHE_UNLINK(&shard->policy, shard->history, shard->protected, item, glyph_sizeof);
+        DL_APPEND(shard->pinned, item);
+    }
+}
 
-    if (z->subpixel_positioning) {
-        glyph_t key;
-        key.codepoint = codepoint;
-        key.frac_x = frac_x;
-        key.frac_y = frac_y;
-        HASH_FIND(hh, z->glyph_cache, &key, keylen, item);
-    } else {
-        HASH_FIND_INT(z->glyph_cache, &codepoint, item);
+/* drops a reference. the last one puts the glyph at the tail of its shard's history list */
+static void unref_glyph(zhban_internal_t *z, glyph_t *item) {
+    if (decref_not_last(&item->refcount))
+        return;
+
+    glyph_shard_t *shard = glyph_shard(z, item->codepoint);
+    pthread_mutex_lock(&shard->lock);
+    if (ZHBAN_DECREF(item->refcount) == 1) {
+        DL_DELETE(shard->pinned, item);
+        CACHE_PUT(z, &shard->policy, shard->history, shard->protected, item, glyph_sizeof, glyph_hashv, shard->limit);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/* called with shard->lock held. looks in the variant's glyph_table slot, then in the overflow table */
+static glyph_t *find_glyph(zhban_internal_t *z, glyph_shard_t *shard, uint32_t codepoint, int32_t frac_x, int32_t frac_y,
+                                                                                                    uint32_t hashv) {
+    glyph_t *item = *glyph_slot(z, codepoint, frac_x, frac_y);
+
+    if (item && (item->frac_x != frac_x || item->frac_y != frac_y))
+        item = NULL;
+    if (!item && shard->overflow) {
+        const int32_t key[3] = { (int32_t)codepoint, frac_x, frac_y };
+        HASH_FIND_BYHASHVALUE(hh, shard->overflow, key, GLYPH_KEY_SIZE, hashv, item);
     }
+    if (item)
+        pin_glyph(shard, item);
+    return item;
+}
+
+/* returns the glyph with its refcount incremented, or NULL if it could not be rendered.
+   may be called from any number of threads, each with its own context. */
+static glyph_t *get_a_glyph(zhban_internal_t *z, shaper_ctx_t *ctx, uint32_t codepoint, int32_t frac_x, int32_t frac_y) {
+    glyph_shard_t *shard;
+    glyph_t *item, *raced;
+    uint32_t hashv;
+
+    if (codepoint >= z->glyph_table_size) {
+        log_error(z, "glyph id %d out of range", codepoint);
+        return NULL;
+    }
+    /* without subpixel positioning there's one variant per glyph, rendered at the pixel grid */
+    if (!z->subpixel_positioning)
+        frac_x = frac_y = 0;
+    shard = glyph_shard(z, codepoint);
+    hashv = glyph_hash(codepoint, frac_x, frac_y);
 
-    z->outer.glyph_gets += 1;
+    ZHBAN_STAT_ADD(z->outer.glyph_gets, 1);
+
+    pthread_mutex_lock(&shard->lock);
+    policy_touch(&shard->policy, hashv);
+    item = find_glyph(z, shard, codepoint, frac_x, frac_y, hashv);
     if (item) {
-        /* put the item at the head of history list*/
-        DL_DELETE(z->glyph_history, item);
-        DL_APPEND(z->glyph_history, item);
-        z->outer.glyph_hits += 1;
+        CACHE_HIT(z, &shard->policy, item);
+        pthread_mutex_unlock(&shard->lock);
+        ZHBAN_STAT_ADD(z->outer.glyph_hits, 1);
         return item;
     }
+    item = get_idle_glyph(z, shard);
+    pthread_mutex_unlock(&shard->lock);
 
-    item = get_idle_glyph(z);
     item->codepoint = codepoint;
     item->frac_x = frac_x;
     item->frac_y = frac_y;
+    item->hashv = hashv;
+    atomic_init(&item->refcount, 0);
 
+    /* rasterize with the shard unlocked, unless the glyph cache file has it. */
     /* suboptimally drop a glyph if rendering failed. */
     /* it's that, or keep a list of them.. since it's very
        rare to fail here, just drop it */
-    if (render_glyph(z, item)) {
-        drop_glyph(item);
-        return NULL;
+    if (map_glyph(z, item) && find_shared_glyph(z, item)) {
+        if (render_glyph(z, ctx, item)) {
+            drop_glyph(item);
+            return NULL;
+        }
+        share_glyph(z, item);
     }
 
-    if (z->subpixel_positioning) {
-        HASH_ADD_KEYPTR(hh, z->glyph_cache, item, keylen, item);
-    } else {
-        HASH_ADD_INT(z->glyph_cache, codepoint, item);
+    pthread_mutex_lock(&shard->lock);
+    /* somebody might have rendered the same glyph meanwhile, theirs wins */
+    raced = find_glyph(z, shard, codepoint, frac_x, frac_y, hashv);
+    if (raced) {
+        pthread_mutex_unlock(&shard->lock);
+        drop_glyph(item);
+        return raced;
     }
-    DL_APPEND(z->glyph_history, item);
-    z->outer.glyph_size += glyph_sizeof(item);
+    link_glyph(z, shard, item);
+    item->segment = CACHE_NEW;
+    DL_APPEND(shard->pinned, item);
+    shard->size += glyph_sizeof(item);
+    ZHBAN_INCREF(item->refcount);
+    pthread_mutex_unlock(&shard->lock);
 
+    ZHBAN_STAT_ADD(z->outer.glyph_size, glyph_sizeof(item));
     return item;
 }
 //}
-//{ shape_t
-/* glyph rendering sequence item. */
-typedef struct _glyph_info {
-    glyph_t  *glyph;        /* points into glyph cache */
-    int32_t   x_origin;     /* in 26.6 pixels */
-    int32_t   y_origin;     /* in 26.6 pixels */
-    uint32_t  cluster;
-}   glyph_info_t;
+//{ glyph cache file
+/*  Rendered glyphs, saved so that the next start does not have to rasterize them again.
+
+    The file is: header, then an index of glyph_table_size + 1 record numbers, glyph id i
+    having records index[i] to index[i + 1] - one per subpixel variant, then the records,
+    then their spans or tiles, each 8-byte aligned. It is only used by a zhban_t with the same
+    font data and size, and hinting, which the header records. Glyph variants are keyed by their
+    subpixel offset, so phase settings need not match.
+
+    Loading maps the file and checks the header. Glyphs are looked up in it on a cache miss,
+    and a record is checked when used; glyph data then points into the mapping as is. */
+
+#define GLYPH_FILE_MAGIC    "zhbanGC"
+#define GLYPH_FILE_VERSION  2
+#define GLYPH_FILE_BOM      0x01020304u  /* written native, so that the other endianness doesn't match */
+
+typedef struct _glyph_file_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t bom;
+    uint64_t font_hash;         /* hash_bytes() of the font data of all faces, mixed */
+    uint32_t pixheight;
+    int32_t  size_width, size_height;  /* FT_Size_Request as settled on by zhban_open() */
+    uint32_t hinted;            /* no subpixel positioning, see render_glyph() */
+    uint32_t glyph_table_size;
+    uint32_t record_count;
+    uint32_t span_size;         /* sizeof(span_t) */
+    uint64_t data_size;
+} glyph_file_header_t;
+
+typedef struct _glyph_record {
+    uint32_t codepoint;
+    int32_t  frac_x, frac_y;
+    int32_t  min_span_x, max_span_x;
+    int32_t  min_y, max_y;
+    uint32_t tiled;
+    uint32_t data_used;
+    uint32_t data_offset;       /* from the start of data */
+    uint64_t next;              /* shared store only: next variant of the glyph id, 0 if none */
+} glyph_record_t;
+
+static inline uint32_t *glyph_file_index(const zhban_internal_t *z) {
+    return (uint32_t *)((char *)z->map + sizeof(glyph_file_header_t));
+}
 
-struct _shape {
+static inline glyph_record_t *glyph_file_records(const zhban_internal_t *z) {
+    return (glyph_record_t *)(glyph_file_index(z) + z->glyph_table_size + 1);
+}
+
+static inline size_t glyph_file_data_offset(uint32_t table_size, uint32_t record_count) {
+    size_t rv = sizeof(glyph_file_header_t) + sizeof(uint32_t) * (table_size + 1) + sizeof(glyph_record_t) * record_count;
+    return (rv + 7) & ~(size_t)7;
+}
+
+static void glyph_file_header(zhban_internal_t *z, glyph_file_header_t *h) {
+    memset(h, 0, sizeof(glyph_file_header_t));
+    memcpy(h->magic, GLYPH_FILE_MAGIC, sizeof(GLYPH_FILE_MAGIC));
+    h->version = GLYPH_FILE_VERSION;
+    h->bom = GLYPH_FILE_BOM;
+    for (uint32_t i = 0; i < z->face_count; i++)
+        h->font_hash = hash_mix(h->font_hash ^ z->faces[i].font->hash, HASH_SECRET1);
+    h->pixheight = z->pixheight;
+    h->size_width = z->faces[0].size_request.width;
+    h->size_height = z->faces[0].size_request.height;
+    h->hinted = !z->subpixel_positioning;
+    h->glyph_table_size = z->glyph_table_size;
+    h->span_size = sizeof(span_t);
+}
+
+/* sanity of a record against the file. nonzero if it's unusable */
+static int check_record(const glyph_record_t *r, uint64_t data_size) {
+    if ((uint64_t)r->data_offset + r->data_used > data_size || r->data_offset % 8)
+        return 1;
+    if (r->min_span_x == INT_MAX)
+        return r->data_used != 0;       /* empty glyph */
+    if (r->max_span_x < r->min_span_x || r->max_y < r->min_y)
+        return 1;
+    if (r->tiled)
+        return ((int64_t)r->max_span_x - r->min_span_x) * ((int64_t)r->max_y - r->min_y + 1) != r->data_used;
+    return r->data_used % sizeof(span_t) != 0;
+}
+
+/* spans of a span record, data being where record data offsets start from: all of them have to lie
+   within the glyph box, atlas_place_glyph() and the renderers trust that. nonzero if any doesn't */
+static int check_spans(const glyph_record_t *r, const char *data) {
+    const span_t *span = (const span_t *)(data + r->data_offset);
+
+    if (r->tiled || r->min_span_x == INT_MAX)
+        return 0;
+    for (uint32_t i = 0; i < r->data_used / sizeof(span_t); i++, span++)
+        if (span->y < r->min_y || span->y > r->max_y || span->len == 0
+                || span->x < r->min_span_x || (int32_t)span->x + span->len > r->max_span_x)
+            return 1;
+    return 0;
+}
+
+static void use_record(glyph_t *, const glyph_record_t *, char *);
+
+/* fills in the glyph from the file, if it has it. returns nonzero if it doesn't */
+static int map_glyph(zhban_internal_t *z, glyph_t *glyph) {
+    if (!z->map)
+        return 1;
+
+    const glyph_file_header_t *h = (glyph_file_header_t *)z->map;
+    const uint32_t *index = glyph_file_index(z);
+    const uint32_t first = index[glyph->codepoint], last = index[glyph->codepoint + 1];
+    const glyph_record_t *r = NULL;
+
+    if (first > last || last > h->record_count)
+        return 1;
+    for (uint32_t i = first; i < last; i++)
+        if (glyph_file_records(z)[i].frac_x == glyph->frac_x && glyph_file_records(z)[i].frac_y == glyph->frac_y) {
+            r = glyph_file_records(z) + i;
+            break;
+        }
+    if (!r || r->codepoint != glyph->codepoint)
+        return 1;
+    char *data = (char *)z->map + glyph_file_data_offset(z->glyph_table_size, h->record_count);
+    if (check_record(r, h->data_size) || check_spans(r, data)) {
+        log_error(z, "glyph %x: bad record, rasterizing", glyph->codepoint);
+        return 1;
+    }
+
+    use_record(glyph, r, data);
+    ZHBAN_STAT_ADD(z->outer.glyph_loaded, 1);
+    return 0;
+}
+
+/* points glyph data at the record's, data being where record data offsets start from */
+static void use_record(glyph_t *glyph, const glyph_record_t *r, char *data) {
+    free(glyph->data);
+    glyph->data = data + r->data_offset;
+    glyph->data_used = r->data_used;
+    glyph->data_allocd = 0;
+    glyph->mapped = 1;
+    glyph->tiled = r->tiled;
+    glyph->min_span_x = r->min_span_x;
+    glyph->max_span_x = r->max_span_x;
+    glyph->min_y = r->min_y;
+    glyph->max_y = r->max_y;
+    glyph->atlas_generation = 0;
+}
+
+static void unmap_glyph_cache(zhban_internal_t *z) {
+    if (z->map)
+        munmap(z->map, z->map_size);
+    z->map = NULL;
+    z->map_size = 0;
+}
+
+int zhban_load_glyph_cache(zhban_t *zhban, const char *path) {
+    zhban_internal_t *z = (zhban_internal_t *)zhban;
+    glyph_file_header_t expected;
+    const glyph_file_header_t *h;
+    struct stat st;
+    void *map;
+    int fd;
+
+    if (z->map) {
+        log_error(z, "a glyph cache file is already loaded");
+        return 1;
+    }
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        log_info(z, "%s: can't open", path);
+        return 1;
+    }
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(glyph_file_header_t)) {
+        close(fd);
+        log_info(z, "%s: too short", path);
+        return 1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        log_error(z, "%s: mmap() failed", path);
+        return 1;
+    }
+
+    h = (glyph_file_header_t *)map;
+    glyph_file_header(z, &expected);
+    expected.record_count = h->record_count;
+    expected.data_size = h->data_size;
+    if (memcmp(h, &expected, sizeof(glyph_file_header_t))
+            || h->record_count > ((size_t)st.st_size - sizeof(glyph_file_header_t)) / sizeof(glyph_record_t)
+            || glyph_file_data_offset(h->glyph_table_size, h->record_count) + h->data_size > (uint64_t)st.st_size) {
+        munmap(map, st.st_size);
+        log_info(z, "%s: made for another font, size or settings, ignored", path);
+        return 1;
+    }
+
+    z->map = map;
+    z->map_size = st.st_size;
+    log_info(z, "%s: %d glyphs", path, h->record_count);
+    return 0;
+}
+
+static void make_record(glyph_record_t *r, const glyph_t *g, uint32_t data_offset) {
+    memset(r, 0, sizeof(glyph_record_t));
+    r->codepoint = g->codepoint;
+    r->frac_x = g->frac_x;
+    r->frac_y = g->frac_y;
+    r->min_span_x = g->min_span_x;
+    r->max_span_x = g->max_span_x;
+    r->min_y = g->min_y;
+    r->max_y = g->max_y;
+    r->tiled = g->tiled;
+    r->data_used = g->data_used;
+    r->data_offset = data_offset;
+}
+
+static int compare_glyphs(const void *a, const void *b) {
+    const glyph_t *ga = *(glyph_t * const *)a, *gb = *(glyph_t * const *)b;
+    if (ga->codepoint != gb->codepoint)
+        return ga->codepoint < gb->codepoint ? -1 : 1;
+    if (ga->frac_x != gb->frac_x)
+        return ga->frac_x < gb->frac_x ? -1 : 1;
+    return ga->frac_y < gb->frac_y ? -1 : ga->frac_y > gb->frac_y;
+}
+
+/* all cached glyphs, slotted and overflow ones, in glyph id order. called with all shard locks held */
+static glyph_t **collect_glyphs(zhban_internal_t *z, uint32_t *count) {
+    uint32_t n = 0;
+    glyph_t **rv;
+
+    for (uint32_t i = 0; i < z->glyph_table_size * z->glyph_slots; i++)
+        n += z->glyph_table[i] != NULL;
+    for (int i = 0; i < GLYPH_SHARDS; i++)
+        n += HASH_COUNT(z->glyph_shards[i].overflow);
+    if (!(rv = malloc((n ? n : 1) * sizeof(glyph_t *))))
+        return NULL;
+
+    *count = 0;
+    for (uint32_t i = 0; i < z->glyph_table_size * z->glyph_slots; i++)
+        if (z->glyph_table[i])
+            rv[(*count)++] = z->glyph_table[i];
+    for (int i = 0; i < GLYPH_SHARDS; i++)
+        for (glyph_t *g = z->glyph_shards[i].overflow; g; g = g->hh.next)
+            rv[(*count)++] = g;
+    qsort(rv, *count, sizeof(glyph_t *), compare_glyphs);
+    return rv;
+}
+
+int zhban_save_glyph_cache(zhban_t *zhban, const char *path) {
+    zhban_internal_t *z = (zhban_internal_t *)zhban;
+    static const uint64_t zeroes = 0;
+    glyph_file_header_t h;
+    glyph_record_t *records = NULL;
+    glyph_t **glyphs = NULL;
+    uint32_t *index, count = 0, i;
+    uint64_t data_size = 0;
+    size_t tmp_len = strlen(path) + 5;
+    char *tmp_path;
+    FILE *fp = NULL;
+    int rv = 1;
+
+    index = malloc(sizeof(uint32_t) * (z->glyph_table_size + 1));
+    tmp_path = malloc(tmp_len);
+    if (!index || !tmp_path)
+        goto out;
+    snprintf(tmp_path, tmp_len, "%s.tmp", path);
+
+    /* all shards are locked so that glyphs stay put while being written */
+    for (int i = 0; i < GLYPH_SHARDS; i++)
+        pthread_mutex_lock(&z->glyph_shards[i].lock);
+    if (!(glyphs = collect_glyphs(z, &count)) || !(records = malloc((count ? count : 1) * sizeof(glyph_record_t))))
+        goto unlock;
+    for (uint32_t cp = 0, j = 0; cp <= z->glyph_table_size; cp++) {
+        while (j < count && glyphs[j]->codepoint < cp)
+            j++;
+        index[cp] = j;
+    }
+    for (i = 0; i < count; i++) {
+        make_record(records + i, glyphs[i], data_size);
+        data_size += (glyphs[i]->data_used + 7) & ~7u;
+    }
+    if (data_size > UINT32_MAX) {
+        log_error(z, "glyph cache too large to save");
+        goto unlock;
+    }
+
+    glyph_file_header(z, &h);
+    h.record_count = count;
+    h.data_size = data_size;
+
+    if (!(fp = fopen(tmp_path, "wb"))) {
+        log_error(z, "%s: can't create", tmp_path);
+        goto unlock;
+    }
+    size_t header_size = sizeof(h) + sizeof(uint32_t) * (z->glyph_table_size + 1) + sizeof(glyph_record_t) * count;
+    if (fwrite(&h, sizeof(h), 1, fp) != 1
+            || fwrite(index, sizeof(uint32_t), z->glyph_table_size + 1, fp) != z->glyph_table_size + 1
+            || fwrite(records, sizeof(glyph_record_t), count, fp) != count
+            || fwrite(&zeroes, 1, glyph_file_data_offset(z->glyph_table_size, count) - header_size, fp)
+                                != glyph_file_data_offset(z->glyph_table_size, count) - header_size)
+        goto unlock;
+    for (i = 0; i < count; i++) {
+        glyph_t *g = glyphs[i];
+        uint32_t pad = ((g->data_used + 7) & ~7u) - g->data_used;
+        if (fwrite(g->data, 1, g->data_used, fp) != g->data_used || fwrite(&zeroes, 1, pad, fp) != pad)
+            goto unlock;
+    }
+    rv = 0;
+
+unlock:
+    for (int i = GLYPH_SHARDS - 1; i >= 0; i--)
+        pthread_mutex_unlock(&z->glyph_shards[i].lock);
+out:
+    if (fp && fclose(fp))
+        rv = 1;
+    if (fp && !rv && rename(tmp_path, path))
+        rv = 1;
+    if (fp && rv)
+        remove(tmp_path);
+    if (rv)
+        log_error(z, "%s: saving failed", path);
+    else
+        log_info(z, "%s: saved %d glyphs", path, count);
+    free(records);
+    free(glyphs);
+    free(index);
+    free(tmp_path);
+    return rv;
+}
+//}
+//{ shared glyph store
+/*  Glyphs shared between processes using the same font at the same size, through a named
+    POSIX shared memory segment. Its header is that of the glyph cache file, followed by
+    an atomic offset of the first record per glyph id, then records, each followed by its data.
+
+    Records are only ever appended: space is taken by bumping the used counter, the record
+    and data are written, and then the record is published by swapping it in at the head of
+    its glyph id's list. Nothing is modified after that, so readers need no locks. Two processes
+    rasterizing the same glyph at once waste some space, but the later one sees the earlier
+    record when publishing, and uses it. When the segment is full, glyphs stay private. */
+
+#define GLYPH_STORE_MAGIC   "zhbanGS"
+
+typedef struct _glyph_store_header {
+    glyph_file_header_t key;    /* record_count and data_size unused */
+    atomic_uint ready;          /* set by whoever created the segment once the header is there */
+    uint32_t padding;
+    atomic_uint_fast64_t used;  /* bytes, from the start of the segment */
+} glyph_store_header_t;
+
+static inline atomic_uint_fast64_t *store_heads(const zhban_internal_t *z) {
+    return (atomic_uint_fast64_t *)((char *)z->store + sizeof(glyph_store_header_t));
+}
+
+static inline glyph_record_t *store_record(const zhban_internal_t *z, uint64_t offset) {
+    return (glyph_record_t *)((char *)z->store + offset);
+}
+
+/* record with the key in the list starting at head and ending at stop, NULL if none. checks records on the way */
+static glyph_record_t *store_find(zhban_internal_t *z, uint64_t head, uint64_t stop, const glyph_t *key) {
+    for (uint64_t offset = head; offset && offset != stop; ) {
+        glyph_record_t *r;
+        if (offset % 8 || offset + sizeof(glyph_record_t) > z->store_size)
+            break;
+        r = store_record(z, offset);
+        if (r->codepoint != key->codepoint
+                || check_record(r, z->store_size - offset - sizeof(glyph_record_t))
+                || check_spans(r, (char *)(r + 1)))
+            break;
+        if (r->frac_x == key->frac_x && r->frac_y == key->frac_y)
+            return r;
+        offset = r->next;
+    }
+    return NULL;
+}
+
+/* fills in the glyph from the store, if it has it. returns nonzero if it doesn't */
+static int find_shared_glyph(zhban_internal_t *z, glyph_t *glyph) {
+    glyph_record_t *r;
+
+    if (!z->store)
+        return 1;
+    r = store_find(z, atomic_load_explicit(store_heads(z) + glyph->codepoint, memory_order_acquire), 0, glyph);
+    if (!r)
+        return 1;
+    use_record(glyph, r, (char *)(r + 1));
+    ZHBAN_STAT_ADD(z->outer.glyph_shared, 1);
+    return 0;
+}
+
+/* puts a freshly rendered glyph into the store, and points it there */
+static void share_glyph(zhban_internal_t *z, glyph_t *glyph) {
+    glyph_store_header_t *h = (glyph_store_header_t *)z->store;
+    const uint64_t size = sizeof(glyph_record_t) + ((glyph->data_used + 7) & ~7u);
+    atomic_uint_fast64_t *head;
+    glyph_record_t *r, *raced;
+    uint64_t offset, first;
+
+    if (!z->store)
+        return;
+    offset = atomic_fetch_add_explicit(&h->used, size, memory_order_relaxed);
+    if (offset + size > z->store_size) {
+        /* full. keep it from growing further so that the counter can't wrap */
+        atomic_store_explicit(&h->used, z->store_size, memory_order_relaxed);
+        return;
+    }
+    r = store_record(z, offset);
+    make_record(r, glyph, 0);
+    memcpy(r + 1, glyph->data, glyph->data_used);
+
+    head = store_heads(z) + glyph->codepoint;
+    first = atomic_load_explicit(head, memory_order_acquire);
+    do {
+        /* whatever got published since we last looked might be this very glyph */
+        if ((raced = store_find(z, first, r->next, glyph))) {
+            r = raced;
+            break;
+        }
+        r->next = first;
+    } while (!atomic_compare_exchange_weak_explicit(head, &first, offset, memory_order_release, memory_order_acquire));
+
+    use_record(glyph, r, (char *)(r + 1));
+}
+
+int zhban_share_glyphs(zhban_t *zhban, const char *name, uint32_t size) {
+    zhban_internal_t *z = (zhban_internal_t *)zhban;
+    const size_t heads_end = sizeof(glyph_store_header_t) + sizeof(atomic_uint_fast64_t) * z->glyph_table_size;
+    glyph_store_header_t *h;
+    glyph_file_header_t expected;
+    struct stat st;
+    int fd, created = 1;
+    void *store;
+
+    if (z->store) {
+        log_error(z, "glyphs are already shared");
+        return 1;
+    }
+    if (size < heads_end + 4096) {
+        log_error(z, "%s: size %d is too small", name, size);
+        return 1;
+    }
+    if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0) {
+        created = 0;
+        if ((fd = shm_open(name, O_RDWR, 0600)) < 0) {
+            log_error(z, "%s: shm_open() failed", name);
+            return 1;
+        }
+    }
+    if (created && ftruncate(fd, size)) {
+        log_error(z, "%s: ftruncate() failed", name);
+        shm_unlink(name);
+        close(fd);
+        return 1;
+    }
+    /* the creator might not have got to ftruncate() yet */
+    for (int tries = 0; !fstat(fd, &st) && st.st_size == 0 && tries < 1000; tries++)
+        nanosleep(&(struct timespec){ 0, 1000000 }, NULL);
+    if ((size_t)st.st_size < heads_end) {
+        log_error(z, "%s: too small", name);
+        close(fd);
+        return 1;
+    }
+    store = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (store == MAP_FAILED) {
+        log_error(z, "%s: mmap() failed", name);
+        return 1;
+    }
+
+    h = (glyph_store_header_t *)store;
+    glyph_file_header(z, &expected);
+    memcpy(expected.magic, GLYPH_STORE_MAGIC, sizeof(GLYPH_STORE_MAGIC));
+    if (created) {
+        /* a fresh segment is all zeroes, heads included */
+        h->key = expected;
+        atomic_store_explicit(&h->used, heads_end, memory_order_relaxed);
+        atomic_store_explicit(&h->ready, 1, memory_order_release);
+    } else {
+        for (int tries = 0; !atomic_load_explicit(&h->ready, memory_order_acquire) && tries < 1000; tries++)
+            nanosleep(&(struct timespec){ 0, 1000000 }, NULL);
+    }
+    if (!atomic_load_explicit(&h->ready, memory_order_acquire) || memcmp(&h->key, &expected, sizeof(expected))) {
+        log_error(z, "%s: in use for another font or size", name);
+        munmap(store, st.st_size);
+        return 1;
+    }
+
+    z->store = store;
+    z->store_size = st.st_size;
+    log_info(z, "%s: %s, %d of %d bytes used", name, created ? "created" : "attached",
+                    (int)atomic_load(&h->used), (int)z->store_size);
+    return 0;
+}
+//}
+//{ shape_t
+/* glyph rendering sequence item. */
+typedef struct _glyph_info {
+    glyph_t  *glyph;        /* points into glyph cache */
+    int32_t   x_origin;     /* in 26.6 pixels */
+    int32_t   y_origin;     /* in 26.6 pixels */
+    uint32_t  cluster;
+}   glyph_info_t;
+
+struct _shape {
     zhban_shape_t shape;
 
-    refcount_t refcount;
+    refcount_t refcount;    /* zero if on a history list */
+    uint32_t segment;       /* CACHE_*, under shaper_lock */
 
     /* USC-2 string, also hash key */
     uint16_t *key;
@@ -587,16 +2076,27 @@ struct _shape {
     uint32_t glyphs_allocd; /* in bytes. see add_glyph_info() */
     uint32_t glyphs_used;   /* in bytes. */
 
+    /* for composing lines out of words */
+    int32_t pen_x, pen_y;       /* pen advance over the whole string, 26.6 */
+    int32_t shift_x, shift_y;   /* translation applied to glyph origins, 26.6 */
+    uint32_t unsafe;            /* SHAPE_UNSAFE_* */
+
     UT_hash_handle hh;
     struct _shape *prev;
     struct _shape *next;
 };
 
+#define SHAPE_UNSAFE_INSIDE 1   /* can't be shaped apart after its first code point */
+
 static inline uint32_t expected_glyph_count(const uint32_t key_size) {
     /* FIXME: ? */
     return 3*key_size/4;
 }
 
+static inline uint32_t shape_hashv(const shape_t *p) {
+    return p->hh.hashv;
+}
+
 static uint32_t shape_sizeof(const shape_t *p) {
     return sizeof(shape_t) + p->key_allocd + p->glyphs_allocd;
 }
@@ -605,7 +2105,7 @@ static uint32_t shape_expected_sizeof(const uint32_t key_size) {
     return sizeof(shape_t) + key_size + sizeof(glyph_info_t) * expected_glyph_count(key_size);
 }
 
-static shape_t *reallocate_shape(shape_t *shape, const uint32_t key_size) {
+static shape_t *reallocate_shape(zhban_internal_t *z, shape_t *shape, const uint32_t key_size) {
     if (!shape) {
         shape = malloc(sizeof(shape_t));
         memset(shape, 0, sizeof(shape_t));
@@ -616,7 +2116,7 @@ static shape_t *reallocate_shape(shape_t *shape, const uint32_t key_size) {
     }
     if (shape->glyphs_used) {
         for (uint32_t i=0; i < shape->glyphs_used/sizeof(glyph_info_t); i++)
-            shape->glyphs[i].glyph->refcount -= 1;
+            unref_glyph(z, shape->glyphs[i].glyph);
         shape->glyphs_used = 0;
     }
     if (shape->glyphs_allocd < sizeof(glyph_info_t) * expected_glyph_count(key_size)) {
@@ -626,63 +2126,79 @@ static shape_t *reallocate_shape(shape_t *shape, const uint32_t key_size) {
     return shape;
 }
 
-static void drop_shape(shape_t *s) {
+static void drop_shape(zhban_internal_t *z, shape_t *s) {
     for (uint32_t i=0; i < s->glyphs_used/sizeof(glyph_info_t); i++)
-        s->glyphs[i].glyph->refcount -= 1;
+        unref_glyph(z, s->glyphs[i].glyph);
     free(s->key);
     free(s->glyphs);
     free(s);
 }
 
-static void drop_shape_cache(shape_t **head) {
+static void drop_shape_cache(zhban_internal_t *z, shape_t **head) {
     shape_t *elt, *tmp;
     HASH_ITER(hh, *head, elt, tmp) {
         HASH_DEL(*head, elt);
-        drop_shape(elt);
+        drop_shape(z, elt);
     }
+    z->shaper_history = z->shaper_protected = z->shaper_pinned = NULL;
 }
 
-static shape_t *get_idle_shape(zhban_internal_t *z, const uint32_t key_size) {
-    shape_t *item, *evicted_item = NULL, *tmp;
-    uint32_t needed_space = shape_expected_sizeof(key_size);
-    log_trace(z, "need %d have %d (%d - %d)", needed_space,
-        z->outer.shaper_limit - z->outer.shaper_size, z->outer.shaper_limit, z->outer.shaper_size);
-
-    /* if we are over the cache size limit, clean up some. */
-    DL_FOREACH_SAFE(z->shaper_history, item, tmp) {
-
-        /* ignore referenced ones */
-        if (ZHBAN_GETREF(item->refcount))
-            continue;
+/* forgets all shapes, as after a change in what strings shape to. those still referenced
+   stay valid, and are dropped with their last reference, see unref_shape() */
+static void flush_shape_cache(zhban_internal_t *z) {
+    shape_t *elt, *tmp;
 
-        /* if we have enough space at last .. */
-        if (needed_space < (z->outer.shaper_limit - z->outer.shaper_size)) {
-            if (evicted_item)
-                /* got it by eviction, reuse item so as to not do free/alloc dance */
-                item = evicted_item;
-            else
-                /* just have free space here; reallocate_shape() will allocate new item */
-                item = NULL;
-            break;
+    pthread_mutex_lock(&z->shaper_lock);
+    HASH_ITER(hh, z->shaper_cache, elt, tmp) {
+        HASH_DELETE(hh, z->shaper_cache, elt);
+        z->outer.shaper_size -= shape_sizeof(elt);
+        if (ZHBAN_GETREF(elt->refcount)) {
+            DL_DELETE(z->shaper_pinned, elt);
+            elt->segment = CACHE_GONE;
+        } else {
+            CACHE_UNLINK(&z->shaper_policy, z->shaper_history, z->shaper_protected, elt, shape_sizeof);
+            drop_shape(z, elt);
         }
+    }
+    pthread_mutex_unlock(&z->shaper_lock);
+}
 
-        /* drop evicted item if we need to evict more than one */
-        if(evicted_item)
-            drop_shape(evicted_item);
+/* called with shaper_lock held. takes the next victim out of the cache, NULL if everything is referenced */
+static shape_t *evict_shape(zhban_internal_t *z) {
+    shape_t *item = CACHE_VICTIM(z->shaper_history, z->shaper_protected);
 
+    if (item) {
         HASH_DELETE(hh, z->shaper_cache, item);
-        DL_DELETE(z->shaper_history, item);
+        CACHE_UNLINK(&z->shaper_policy, z->shaper_history, z->shaper_protected, item, shape_sizeof);
         z->outer.shaper_size -= shape_sizeof(item);
         z->outer.shaper_evictions += 1;
+    }
+    return item;
+}
+
+/* called with shaper_lock held. */
+static shape_t *get_idle_shape(zhban_internal_t *z, const uint32_t key_size) {
+    shape_t *item, *evicted_item = NULL;
+    uint32_t needed_space = shape_expected_sizeof(key_size);
+    log_trace(z, "need %d have %d (%d - %d - %d)", needed_space,
+        z->outer.shaper_limit - z->outer.shaper_size - z->shaper_reserved, z->outer.shaper_limit,
+        z->outer.shaper_size, z->shaper_reserved);
+
+    /* if we are over the cache size limit, clean up some. everything on the history list is unreferenced. */
+    while (z->outer.shaper_size + z->shaper_reserved + needed_space >= z->outer.shaper_limit
+                && (item = evict_shape(z))) {
+        /* drop evicted item if we need to evict more than one */
+        if(evicted_item)
+            drop_shape(z, evicted_item);
         evicted_item = item;
     }
 
-    /* end up here with either an item to be reused (storage not touched),
-       or with item == NULL, in case either there's space in the cache to use,
+    /* end up here with either an evicted item to be reused (storage not touched),
+       or with NULL, in case either there's space in the cache to use,
        or we failed to free up space in the cache (like, too much shapes with
        refcount > 0), in which case we ignore the cache size limit. */
 
-    shape_t *rv = reallocate_shape(item, key_size);
+    shape_t *rv = reallocate_shape(z, evicted_item, key_size);
 
     /* grow cache to avoid thrashing (?) */
     if (z->outer.shaper_limit < z->outer.shaper_size) {
@@ -693,6 +2209,7 @@ static shape_t *get_idle_shape(zhban_internal_t *z, const uint32_t key_size) {
     return rv;
 }
 
+/* takes over the glyph reference from get_a_glyph() */
 static void add_glyph_info(shape_t *dst, glyph_t *glyph, int32_t x_origin, int32_t y_origin, uint32_t cluster) {
     if (dst->glyphs_used == dst->glyphs_allocd) {
         /* reallocate with some space (25%+2 more glyphs) to spare */
@@ -701,7 +2218,6 @@ static void add_glyph_info(shape_t *dst, glyph_t *glyph, int32_t x_origin, int32
     }
     int i = dst->glyphs_used/sizeof(glyph_info_t);
     dst->glyphs[i].glyph = glyph;
-    glyph->refcount += 1;
     dst->glyphs[i].x_origin = x_origin;
     dst->glyphs[i].y_origin = y_origin;
     dst->glyphs[i].cluster  = cluster;
@@ -722,68 +2238,72 @@ static inline int32_t grid_fit_266(int32_t value) {
             ((value>>6) - (value & 0x3f ? 1 : 0)) ;
 }
 
-static void shape_string(zhban_internal_t *z, shape_t *item) {
-    int x = 0, y = 0; // pen position, FT 26.6
-    //int horizontal = HB_DIRECTION_IS_HORIZONTAL(hb_buffer_get_direction(z->hb_buffer));
-
-    int max_x = INT_MIN; // largest coordinate a pixel has been set at, or the pen was advanced to.
-    int min_x = INT_MAX; // smallest coordinate a pixel has been set at, or the pen was advanced to.
-    int max_y = INT_MIN; // this is max topside bearing along the string.
-    int min_y = INT_MAX; // this is max value of (height - topbearing) along the string.
+/* string extents along the pen path, 26.6 */
+typedef struct _extents {
+    int max_x; // largest coordinate a pixel has been set at, or the pen was advanced to.
+    int min_x; // smallest coordinate a pixel has been set at, or the pen was advanced to.
+    int max_y; // this is max topside bearing along the string.
+    int min_y; // this is max value of (height - topbearing) along the string.
     /*  Naturally, the above comments swap their meaning between horizontal and vertical scripts,
         since the pen changes the axis it is advanced along.
         However, their differences still make up the bounding box for the string.
         Also note that all this is in FT coordinate system where y axis points upwards.
      */
+} extents_t;
 
+static void start_shape(shape_t *item, extents_t *e) {
     item->glyphs_used = 0; // reset glyph info/position storage
+    item->unsafe = 0;
+    e->max_x = INT_MIN;
+    e->min_x = INT_MAX;
+    e->max_y = INT_MIN;
+    e->min_y = INT_MAX;
+}
 
-    hb_buffer_clear_contents(z->hb_buffer);
-    /* do those three need be done after _clear_contents() ? */
-    hb_buffer_set_direction(z->hb_buffer, z->hb_direction);
-    hb_buffer_set_script(z->hb_buffer, z->hb_script);
-    hb_buffer_set_language(z->hb_buffer, z->hb_language);
-    hb_buffer_add_utf16(z->hb_buffer, item->key, item->key_size/2, 0, item->key_size/2);
+/* appends a glyph placed at gx, gy, taking over the reference */
+static void place_glyph(zhban_internal_t *z, shape_t *item, extents_t *e, glyph_t *glyph,
+                                                int32_t gx, int32_t gy, uint32_t cluster) {
+    if (glyph->min_span_x != INT_MAX) {
+    /* Update values if the spanner was actually called. */
+        if (e->min_x > (glyph->min_span_x<<6) + gx)
+            e->min_x = (glyph->min_span_x<<6) + gx;
 
-    hb_shape(z->hb_font, z->hb_buffer, NULL, 0);
+        if (e->max_x < (glyph->max_span_x<<6) + gx)
+            e->max_x = (glyph->max_span_x<<6) + gx;
 
-    uint32_t glyph_count;
-    hb_glyph_info_t     *glyph_info = hb_buffer_get_glyph_infos(z->hb_buffer, &glyph_count);
-    hb_glyph_position_t *glyph_pos  = hb_buffer_get_glyph_positions(z->hb_buffer, &glyph_count);
-
-    for (uint32_t j = 0; j < glyph_count; ++j) {
-        int32_t gx = x + glyph_pos[j].x_offset;
-        int32_t gy = y + glyph_pos[j].y_offset;
-        glyph_t *glyph = get_a_glyph(z, glyph_info[j].codepoint, gx & 0x3f, gy & 0x3f);
-        if (glyph) {
-            if (glyph->min_span_x != INT_MAX) {
-            /* Update values if the spanner was actually called. */
-                if (min_x > (glyph->min_span_x<<6) + gx)
-                    min_x = (glyph->min_span_x<<6) + gx;
-
-                if (max_x < (glyph->max_span_x<<6) + gx)
-                    max_x = (glyph->max_span_x<<6) + gx;
-
-                if (min_y > (glyph->min_y<<6) + gy)
-                    min_y = (glyph->min_y<<6) + gy;
-
-                if (max_y < (glyph->max_y<<6) + gy)
-                    max_y = (glyph->max_y<<6) + gy;
-            } else {
-            /* The spanner wasn't called at all - an empty glyph, like space. */
-                if (min_x > gx) min_x = gx;
-                if (max_x < gx) max_x = gx;
-                if (min_y > gy) min_y = gy;
-                if (max_y < gy) max_y = gy;
-                log_trace(z, "glyph %d: empty.", j); /* can't skip rendering it though? */
-            }
-            add_glyph_info(item, glyph, gx, gy, glyph_info[j].cluster);
-            log_trace(z, "glyph %d at %d.%d, %d.%d", j,
-                gx>>6, 100*abs(gx&0x3f)/64, gy>>6, 100*abs(gy&0x3f)/64);
-        } /* else render_glyph() failed, skip it */
-        x += glyph_pos[j].x_advance;
-        y += glyph_pos[j].y_advance;
+        if (e->min_y > (glyph->min_y<<6) + gy)
+            e->min_y = (glyph->min_y<<6) + gy;
+
+        if (e->max_y < (glyph->max_y<<6) + gy)
+            e->max_y = (glyph->max_y<<6) + gy;
+    } else {
+    /* The spanner wasn't called at all - an empty glyph, like space. */
+        if (e->min_x > gx) e->min_x = gx;
+        if (e->max_x < gx) e->max_x = gx;
+        if (e->min_y > gy) e->min_y = gy;
+        if (e->max_y < gy) e->max_y = gy;
+        log_trace(z, "glyph %x: empty.", glyph->codepoint); /* can't skip rendering it though? */
     }
+    add_glyph_info(item, glyph, gx, gy, cluster);
+    log_trace(z, "glyph %x at %d.%d, %d.%d", glyph->codepoint,
+        gx>>6, 100*abs(gx&0x3f)/64, gy>>6, 100*abs(gy&0x3f)/64);
+}
+
+/* snaps a 26.6 glyph position to the nearest of 'phases' evenly spaced subpixel offsets.
+   the glyph is then both rasterized and placed there, so the rounding error goes into its origin. */
+static inline int32_t phase_offset(int32_t phase, uint32_t phases) {
+    return (phase * 64 + (int32_t)phases / 2) / (int32_t)phases;
+}
+
+static inline int32_t snap_phase(int32_t pos, uint32_t phases) {
+    if (phases >= 64)
+        return pos;
+    return (pos & ~0x3f) + phase_offset(((pos & 0x3f) * phases + 32) >> 6, phases);
+}
+
+/* computes bounding box and origin given final pen position x, y */
+static void finish_shape(zhban_internal_t *z, shape_t *item, extents_t *e, int32_t x, int32_t y) {
+    int min_x = e->min_x, max_x = e->max_x, min_y = e->min_y, max_y = e->max_y;
 
     if (min_x > x) min_x = x;
     if (max_x < x) max_x = x;
@@ -822,6 +2342,10 @@ static void shape_string(zhban_internal_t *z, shape_t *item) {
 
     /* adjust glyph origins - effectively move (0,0) around so that all pixels fit into the bitmap */
     adjust_glyph_origin(item, origin_x, origin_y);
+    item->pen_x = x;
+    item->pen_y = y;
+    item->shift_x = origin_x;
+    item->shift_y = origin_y;
 
     log_trace(z, "26.6 w,h =  %d.%d, %d.%d origin = %d.%d, %d.%d",
                 w>>6, 100*abs(w&0x3f)/64, h>>6, 100*abs(h&0x3f)/64,
@@ -836,199 +2360,1283 @@ static void shape_string(zhban_internal_t *z, shape_t *item) {
         item->shape.w, item->shape.h, item->shape.origin_x, item->shape.origin_y, item);
 }
 
-zhban_shape_t *zhban_shape(zhban_t *zhban, const uint16_t *string, const uint32_t strsize) {
-    zhban_internal_t *z = (zhban_internal_t *)zhban;
-    shape_t *item;
-
-    z->outer.shaper_gets += 1;
-    HASH_FIND(hh, z->shaper_cache, string, strsize, item);
-    if (item) {
-        /* put the item at the head of history list*/
-        DL_DELETE(z->shaper_history, item);
-        DL_APPEND(z->shaper_history, item);
-        ZHBAN_INCREF(item->refcount);
-        z->outer.shaper_hits += 1;
-        return (zhban_shape_t *)item;
-    }
+#if HB_VERSION_ATLEAST(3,3,0)
+#define UNSAFE_GLYPH_FLAGS (HB_GLYPH_FLAG_UNSAFE_TO_BREAK | HB_GLYPH_FLAG_UNSAFE_TO_CONCAT)
+#else
+#define UNSAFE_GLYPH_FLAGS HB_GLYPH_FLAG_UNSAFE_TO_BREAK
+#endif
 
-    item = get_idle_shape(z, strsize);
-    memcpy(item->key, string, strsize);
-    item->key_size = strsize;
+/* decodes the UTF-16 character at *at, moving past it */
+static uint32_t next_char(const uint16_t *string, uint32_t length, uint32_t *at) {
+    uint32_t c = string[(*at)++];
+    if (c >= 0xD800 && c < 0xDC00 && *at < length && string[*at] >= 0xDC00 && string[*at] < 0xE000)
+        c = 0x10000 + ((c - 0xD800) << 10) + (string[(*at)++] - 0xDC00);
+    return c;
+}
 
-    shape_string(z, item);
+/* first face in priority order that has the character, or -1 */
+static int32_t char_face(zhban_internal_t *z, shaper_ctx_t *ctx, uint32_t c) {
+    for (uint32_t f = 0; f < z->face_count; f++)
+        if (FT_Get_Char_Index(ctx->ft_faces[f], c))
+            return f;
+    return -1;
+}
 
-    HASH_ADD_KEYPTR(hh, z->shaper_cache, item->key, item->key_size, item);
-    DL_APPEND(z->shaper_history, item);
-    z->outer.shaper_size += shape_sizeof(item);
-    ZHBAN_INCREF(item->refcount);
+/* glyph cache glyph id for the character, from the first face that has it. 0 if none does */
+static uint32_t char_glyph(zhban_internal_t *z, shaper_ctx_t *ctx, uint32_t c) {
+    int32_t f = char_face(z, ctx, c);
+    return f < 0 ? 0 : z->faces[f].glyph_base + FT_Get_Char_Index(ctx->ft_faces[f], c);
+}
 
-    return (zhban_shape_t *)item;
+/* spaces, punctuation, digits, combining marks: these stay with the face of the text around them */
+static inline int char_is_neutral(uint32_t c) {
+    return (c < 0x80 && !((c | 0x20) >= 'a' && (c | 0x20) <= 'z'))
+        || (c >= 0xA0 && c < 0xC0) || (c >= 0x300 && c < 0x370)
+        || (c >= 0x2000 && c < 0x2070) || (c >= 0x3000 && c < 0x3040);
 }
 
-void zhban_release_shape(zhban_t *zhban, zhban_shape_t *zs) {
-    shape_t *s = (shape_t *)zs;
+/*  splits the string into runs by face: each character goes with the first face having it,
+    except neutral ones, which stay in the run they are in if its face has them. characters no face
+    has stay in the run too. runs go to ctx->runs, grown as needed; returns their count.
+    should that fail, the rest of the string goes into the last run. */
+static uint32_t split_runs(zhban_internal_t *z, shaper_ctx_t *ctx, const uint16_t *string, uint32_t length) {
+    uint32_t count = 0, at = 0;
+    int full = 0;
 
-    if (ZHBAN_GETREF(s->refcount) == 0)
-        log_fatal((zhban_internal_t *)zhban, "releasing already free shape");
-    ZHBAN_DECREF(s->refcount);
+    if (z->face_count == 1) {
+        ctx->runs[0] = (face_run_t){ 0, length, 0 };
+        return 1;
+    }
+    while (at < length) {
+        const uint32_t from = at;
+        const uint32_t c = next_char(string, length, &at);
+        face_run_t *last = count ? ctx->runs + count - 1 : NULL;
+        int32_t face;
+
+        if (last && (full || (char_is_neutral(c) && FT_Get_Char_Index(ctx->ft_faces[last->face], c)))) {
+            last->end = at;
+            continue;
+        }
+        face = char_face(z, ctx, c);
+        if (last && (face < 0 || face == (int32_t)last->face)) {
+            last->end = at;
+            continue;
+        }
+        if (count == ctx->runs_allocd) {
+            face_run_t *runs = realloc(ctx->runs, 2 * ctx->runs_allocd * sizeof(face_run_t));
+            if (!runs) {
+                log_error(z, "realloc() failed, %d runs", count);
+                full = 1;
+                last->end = at;
+                continue;
+            }
+            ctx->runs = runs;
+            ctx->runs_allocd *= 2;
+        }
+        ctx->runs[count++] = (face_run_t){ from, at, face < 0 ? 0 : face };
+    }
+    return count;
 }
 
-//}
-//{ bitmap_t
-struct _bitmap {
-    zhban_bitmap_t bitmap;
+/* shapes a run of the string into ctx->hb_buffer */
+static void shape_run(zhban_internal_t *z, shaper_ctx_t *ctx, const uint16_t *string, uint32_t length,
+                                                        const face_run_t *run, uint32_t unsafe_to_concat) {
+    /* _clear_contents() resets segment properties too */
+    hb_buffer_clear_contents(ctx->hb_buffer);
+    hb_buffer_set_segment_properties(ctx->hb_buffer, &z->hb_props);
+    /* the whole string goes in as context, clusters are then indices into it */
+    hb_buffer_add_utf16(ctx->hb_buffer, string, length, run->start, run->end - run->start);
+
+#if HB_VERSION_ATLEAST(3,3,0)
+    /* flags survive _clear_contents(), put them back for whoever gets the context next */
+    if (unsafe_to_concat) {
+        const hb_buffer_flags_t flags = hb_buffer_get_flags(ctx->hb_buffer);
+        hb_buffer_set_flags(ctx->hb_buffer, flags | HB_BUFFER_FLAG_PRODUCE_UNSAFE_TO_CONCAT);
+        hb_shape(ctx->hb_fonts[run->face], ctx->hb_buffer, NULL, 0);
+        hb_buffer_set_flags(ctx->hb_buffer, flags);
+        return;
+    }
+#else
+    (void)unsafe_to_concat;
+#endif
+    hb_shape(ctx->hb_fonts[run->face], ctx->hb_buffer, NULL, 0);
+}
 
-    shape_t *shape;       /* out there in the shaper. also - key. */
+static void shape_string(zhban_internal_t *z, shaper_ctx_t *ctx, shape_t *item) {
+    int x = 0, y = 0; // pen position, FT 26.6
+    //int horizontal = HB_DIRECTION_IS_HORIZONTAL(hb_buffer_get_direction(ctx->hb_buffer));
+    extents_t e;
+    int cut = 0;    // some glyph starts past the first code point
 
-    uint32_t data_allocd;
+    start_shape(item, &e);
 
-    UT_hash_handle hh;
-    struct _bitmap *prev;
-    struct _bitmap *next;
-};
+    const uint32_t run_count = split_runs(z, ctx, item->key, item->key_size/2);
+    const face_run_t *runs = ctx->runs;
+    const int backward = HB_DIRECTION_IS_BACKWARD(z->hb_props.direction);
 
-static uint32_t bitmap_sizeof(const bitmap_t *p) {
-    return sizeof(bitmap_t) + p->data_allocd;
-}
+    for (uint32_t r = 0; r < run_count; r++) {
+        /* glyphs come out in visual order, so right-to-left runs go last to first */
+        const face_run_t *run = runs + (backward ? run_count - 1 - r : r);
+        const uint32_t glyph_base = z->faces[run->face].glyph_base;
 
-static uint32_t bitmap_data_expected_size(const shape_t *zs) {
-    /* FIXME for vertical scripts - cluster map strip */
-    return (zs->shape.w + 0) * (zs->shape.h + 1) * 4;
-}
+        shape_run(z, ctx, item->key, item->key_size/2, run, z->word_cache);
 
-static uint32_t bitmap_expected_sizeof(const shape_t *shape) {
-    return sizeof(bitmap_t) + bitmap_data_expected_size(shape);
-}
+        uint32_t glyph_count;
+        hb_glyph_info_t     *glyph_info = hb_buffer_get_glyph_infos(ctx->hb_buffer, &glyph_count);
+        hb_glyph_position_t *glyph_pos  = hb_buffer_get_glyph_positions(ctx->hb_buffer, &glyph_count);
 
-static bitmap_t *reallocate_bitmap(const shape_t *shape, bitmap_t *bitmap) {
-    if (!bitmap) {
-        bitmap = malloc(sizeof(bitmap_t));
-        memset(bitmap, 0, sizeof(bitmap_t));
-    } else {
-        if (bitmap->shape) {
-            ZHBAN_DECREF(bitmap->shape->refcount);
-            bitmap->shape = NULL;
+        for (uint32_t j = 0; j < glyph_count; ++j) {
+            int32_t gx = x + glyph_pos[j].x_offset;
+            int32_t gy = y + glyph_pos[j].y_offset;
+            if (z->subpixel_positioning) {
+                gx = snap_phase(gx, z->phases_x);
+                gy = snap_phase(gy, z->phases_y);
+            }
+            glyph_t *glyph = get_a_glyph(z, ctx, glyph_base + glyph_info[j].codepoint, gx & 0x3f, gy & 0x3f);
+            if (glyph)
+                place_glyph(z, item, &e, glyph, gx, gy, glyph_info[j].cluster);
+            /* else render_glyph() failed, skip it */
+            x += glyph_pos[j].x_advance;
+            y += glyph_pos[j].y_advance;
+
+            /* the flags are about breaking before the glyph; the first cluster is always 0 */
+            if (glyph_info[j].cluster) {
+                cut = 1;
+                if (hb_glyph_info_get_glyph_flags(glyph_info + j) & UNSAFE_GLYPH_FLAGS)
+                    item->unsafe |= SHAPE_UNSAFE_INSIDE;
+            }
         }
     }
-    uint32_t data_size = bitmap_data_expected_size(shape);
-    if (bitmap->data_allocd < data_size) {
-        bitmap->data_allocd = data_size;
-        bitmap->bitmap.data = realloc(bitmap->bitmap.data, bitmap->data_allocd);
-    }
-    return bitmap;
-}
+    /* all of it went into one cluster, a ligature say */
+    if (!cut)
+        item->unsafe |= SHAPE_UNSAFE_INSIDE;
 
-static void drop_bitmap(bitmap_t *z) {
-    if (z->shape)
-        ZHBAN_DECREF(z->shape->refcount);
-    free(z->bitmap.data);
-    free(z);
+    finish_shape(z, item, &e, x, y);
 }
 
-static void drop_bitmap_cache(bitmap_t **head) {
-    bitmap_t *elt, *tmp;
-    HASH_ITER(hh, *head, elt, tmp) {
-        HASH_DEL(*head, elt);
-        drop_bitmap(elt);
+/* called with shaper_lock held. takes a reference, moving the shape off the history list if it was there */
+static void pin_shape(zhban_internal_t *z, shape_t *item) {
+    if (ZHBAN_INCREF(item->refcount) == 0) {
+        CACHE_UNLINK(&z->shaper_policy, z->shaper_history, z->shaper_protected, item, shape_sizeof);
+        DL_APPEND(z->shaper_pinned, item);
     }
 }
 
-/* return a shape_t that can be (re)used for a given key_size minding cache size limit. */
-static bitmap_t *get_idle_bitmap(zhban_internal_t *z, const shape_t *shape) {
-    bitmap_t *item, *evicted_item = NULL, *tmp;
-    uint32_t needed_space = bitmap_expected_sizeof(shape);
-
-    /* if we are over the cache size limit, clean up some. */
-    DL_FOREACH_SAFE(z->bitmap_history, item, tmp) {
-        /* if we have enough space at last .. */
-        if (needed_space < (z->outer.bitmap_limit - z->outer.bitmap_size)) {
-            if (evicted_item)
-                /* got it by eviction, reuse item so as to not do free/alloc dance */
-                item = evicted_item;
-            else
-                /* just have free space here; reallocate_shape() will allocate new item */
-                item = NULL;
-            break;
+/* drops a reference. the last one puts the shape at the tail of the history list */
+static void unref_shape(zhban_internal_t *z, shape_t *item) {
+    if (decref_not_last(&item->refcount))
+        return;
+
+    pthread_mutex_lock(&z->shaper_lock);
+    if (ZHBAN_DECREF(item->refcount) == 1) {
+        if (item->segment == CACHE_GONE) {
+            pthread_mutex_unlock(&z->shaper_lock);
+            drop_shape(z, item);
+            return;
         }
-
-        /* drop evicted item if we need to evict more that one */
-        if(evicted_item)
-            drop_bitmap(evicted_item);
-
-        HASH_DELETE(hh, z->bitmap_cache, item);
-        DL_DELETE(z->bitmap_history, item);
-        z->outer.bitmap_size -= bitmap_sizeof(item);
-        z->outer.bitmap_evictions += 1;
-        evicted_item = item;
+        DL_DELETE(z->shaper_pinned, item);
+        CACHE_PUT(z, &z->shaper_policy, z->shaper_history, z->shaper_protected, item, shape_sizeof, shape_hashv,
+                                                                            z->outer.shaper_limit);
     }
+    pthread_mutex_unlock(&z->shaper_lock);
+}
 
-    bitmap_t *rv = reallocate_bitmap(shape, item);
-
-    /* grow cache to avoid thrashing (?) */
-    if (z->outer.bitmap_limit < z->outer.bitmap_size) {
-        log_trace(z, "grew cache from %d to %d", z->outer.bitmap_limit, z->outer.bitmap_size);
-        z->outer.bitmap_limit = z->outer.bitmap_size;
-    }
+/* called with shaper_lock held. increments refcount of what's found. */
+static shape_t *find_shape(zhban_internal_t *z, const uint16_t *string, const uint32_t strsize, unsigned hashv) {
+    shape_t *item;
 
-    return rv;
+    HASH_FIND_BYHASHVALUE(hh, z->shaper_cache, string, strsize, hashv, item);
+    if (item)
+        pin_shape(z, item);
+    return item;
 }
 
-//}
-//{ renderer
-static void render_shape(zhban_internal_t *z, bitmap_t *item) {
-    shape_t *sh = item->shape;
-
-    memset(item->bitmap.data, 0, (sh->shape.w) * (sh->shape.h + 1) * 4);
+/* same, for a request, as opposed to a check for a racing insert */
+static shape_t *lookup_shape(zhban_internal_t *z, const uint16_t *string, const uint32_t strsize, unsigned hashv) {
+    shape_t *item;
 
-    const  int32_t  pitch = sh->shape.w;  /* must be signed, or hilarity ensues */
-    const uint32_t *first_pixel = item->bitmap.data;
-    const uint32_t *last_pixel = item->bitmap.data + sh->shape.w * sh->shape.h - 1;
+    policy_touch(&z->shaper_policy, hashv);
+    if ((item = find_shape(z, string, strsize, hashv)))
+        CACHE_HIT(z, &z->shaper_policy, item);
+    return item;
+}
+
+/* called with shaper_lock held. puts freshly shaped item into the cache, unless
+   somebody has done the same meanwhile, in which case theirs is returned instead
+   and the item is to be dropped. either way refcount of what's returned is incremented. */
+static shape_t *insert_shape(zhban_internal_t *z, shape_t *item, unsigned hashv) {
+    shape_t *raced = find_shape(z, item->key, item->key_size, hashv);
+    if (raced)
+        return raced;
+
+    HASH_ADD_KEYPTR_BYHASHVALUE(hh, z->shaper_cache, item->key, item->key_size, hashv, item);
+    item->segment = CACHE_NEW;
+    DL_APPEND(z->shaper_pinned, item);
+    z->outer.shaper_size += shape_sizeof(item);
+    ZHBAN_INCREF(item->refcount);
+    return item;
+}
+
+/* returns cached shape of a piece of a line, shaping it if not found, refcount incremented. */
+static shape_t *get_word(zhban_internal_t *z, shaper_ctx_t *ctx, const uint16_t *string, const uint32_t strsize) {
+    shape_t *item, *inserted;
+    unsigned hashv;
+
+    HASH_VALUE(string, strsize, hashv);
+
+    pthread_mutex_lock(&z->shaper_lock);
+    z->outer.word_gets += 1;
+    item = lookup_shape(z, string, strsize, hashv);
+    if (item) {
+        z->outer.word_hits += 1;
+        pthread_mutex_unlock(&z->shaper_lock);
+        return item;
+    }
+    item = get_idle_shape(z, strsize);
+    pthread_mutex_unlock(&z->shaper_lock);
+
+    memcpy(item->key, string, strsize);
+    item->key_size = strsize;
+    shape_string(z, ctx, item);
+
+    pthread_mutex_lock(&z->shaper_lock);
+    inserted = insert_shape(z, item, hashv);
+    pthread_mutex_unlock(&z->shaper_lock);
+    if (inserted != item)
+        drop_shape(z, item);
+
+    return inserted;
+}
+
+/* words and runs of spaces between them are cached apart.
+   returns index past the end of the one starting at 'at' */
+static uint32_t next_word(const uint16_t *string, const uint32_t length, uint32_t at) {
+    const int space = string[at] == 0x20;
+    while (at < length && (string[at] == 0x20) == space)
+        at++;
+    return at;
+}
+
+/* whether what's either side of 'at' shapes differently together than apart. HarfBuzz flags
+   describe the break before a glyph, so the code points around 'at' are shaped in context, cached
+   like words, and the glyph starting the right one is looked at. */
+static int unsafe_join(zhban_internal_t *z, shaper_ctx_t *ctx, const uint16_t *string, const uint32_t length,
+                                                                                            uint32_t at) {
+    uint32_t from = at - 1, to = at + 1;
+    int rv;
+
+    if (from > 0 && (string[from] & 0xFC00) == 0xDC00)
+        from -= 1;
+    if (to < length && (string[to] & 0xFC00) == 0xDC00)
+        to += 1;
+    shape_t *join = get_word(z, ctx, string + from, (to - from) * 2);
+    rv = join->unsafe & SHAPE_UNSAFE_INSIDE;
+    zhban_release_shape(&z->outer, &join->shape);
+    return rv;
+}
+
+/* copies glyphs of a word placed at pen position x, y. clusters are offset by 'start' */
+static void append_word(zhban_internal_t *z, shaper_ctx_t *ctx, shape_t *item, extents_t *e,
+                                    const shape_t *word, uint32_t start, int32_t x, int32_t y) {
+    for (uint32_t i = 0; i < word->glyphs_used / sizeof(glyph_info_t); i++) {
+        const glyph_info_t *g_info = word->glyphs + i;
+        int32_t word_x = g_info->x_origin - word->shift_x;
+        int32_t word_y = g_info->y_origin - word->shift_y;
+        int32_t gx = x + word_x, gy = y + word_y;
+        glyph_t *glyph = g_info->glyph;
+
+        if (z->subpixel_positioning) {
+            gx = snap_phase(gx, z->phases_x);
+            gy = snap_phase(gy, z->phases_y);
+        }
+        if (z->subpixel_positioning && ((gx & 0x3f) != glyph->frac_x || (gy & 0x3f) != glyph->frac_y)) {
+            /* ended up at a different subpixel offset, need another variant */
+            if (!(glyph = get_a_glyph(z, ctx, glyph->codepoint, gx & 0x3f, gy & 0x3f)))
+                continue;
+        } else {
+            ZHBAN_INCREF(glyph->refcount);
+        }
+        place_glyph(z, item, e, glyph, gx, gy, g_info->cluster + start);
+    }
+}
+
+/* builds line glyph list out of cached word shapes.
+   words that HarfBuzz says can't be shaped apart are shaped together. */
+static void compose_words(zhban_internal_t *z, shaper_ctx_t *ctx, shape_t *item) {
+    const uint16_t *string = item->key;
+    const uint32_t length = item->key_size / 2;
+    int32_t x = 0, y = 0;
+    extents_t e;
+
+    start_shape(item, &e);
+
+    uint32_t start = 0;
+    while (start < length) {
+        uint32_t end = next_word(string, length, start);
+
+        /* take in what follows for as long as it can't be cut off */
+        while (end < length && unsafe_join(z, ctx, string, length, end))
+            end = next_word(string, length, end);
+
+        shape_t *word = get_word(z, ctx, string + start, (end - start) * 2);
+        append_word(z, ctx, item, &e, word, start, x, y);
+        x += word->pen_x;
+        y += word->pen_y;
+        zhban_release_shape(&z->outer, &word->shape);
+        start = end;
+    }
+
+    finish_shape(z, item, &e, x, y);
+}
+
+/* shapes a line, directly or out of words */
+static void shape_item(zhban_internal_t *z, shaper_ctx_t *ctx, shape_t *item) {
+    if (z->word_cache && z->hb_props.direction == HB_DIRECTION_LTR
+                && next_word(item->key, item->key_size / 2, 0) < item->key_size / 2)
+        compose_words(z, ctx, item);
+    else
+        shape_string(z, ctx, item);
+}
+
+static int slice_line(zhban_internal_t *, shaper_ctx_t *, const zhban_paragraph_t *, shape_t *, const uint16_t *);
+
+/*  hashv is HASH_VALUE() of the string, maybe precomputed.
+    para - if not NULL, the string is a line of it, to be cut out of it if possible, see zhban_paragraph_line() */
+static zhban_shape_t *shape_hashed(zhban_internal_t *z, const uint16_t *string, const uint32_t strsize, unsigned hashv,
+                                                                                    const zhban_paragraph_t *para) {
+    shaper_ctx_t *ctx;
+    shape_t *item, *inserted;
+
+    pthread_mutex_lock(&z->shaper_lock);
+    z->outer.shaper_gets += 1;
+    item = lookup_shape(z, string, strsize, hashv);
+    if (item) {
+        z->outer.shaper_hits += 1;
+        pthread_mutex_unlock(&z->shaper_lock);
+        return (zhban_shape_t *)item;
+    }
+    item = get_idle_shape(z, strsize);
+    pthread_mutex_unlock(&z->shaper_lock);
+
+    memcpy(item->key, string, strsize);
+    item->key_size = strsize;
+
+    /* shape with the cache unlocked. */
+    if (!(ctx = acquire_ctx(z))) {
+        drop_shape(z, item);
+        return NULL;
+    }
+    if (!para || slice_line(z, ctx, para, item, string))
+        shape_item(z, ctx, item);
+    release_ctx(z, ctx);
+
+    pthread_mutex_lock(&z->shaper_lock);
+    inserted = insert_shape(z, item, hashv);
+    pthread_mutex_unlock(&z->shaper_lock);
+    if (inserted != item)
+        drop_shape(z, item);
+
+    return (zhban_shape_t *)inserted;
+}
+
+zhban_shape_t *zhban_shape(zhban_t *zhban, const uint16_t *string, const uint32_t strsize) {
+    unsigned hashv;
+
+    HASH_VALUE(string, strsize, hashv);
+    return shape_hashed((zhban_internal_t *)zhban, string, strsize, hashv, NULL);
+}
+
+#define BATCH_UNUSED UINT32_MAX
+
+void zhban_shape_batch(zhban_t *zhban, const uint16_t **strings, const uint32_t *strsizes, uint32_t count,
+                                                                                zhban_shape_t **shapes) {
+    zhban_internal_t *z = (zhban_internal_t *)zhban;
+    shaper_ctx_t *ctx;
+    uint32_t table_size = 16, unique = 0, misses = 0, hits = 0;
+
+    if (!count)
+        return;
+    if (!(ctx = acquire_ctx(z))) {
+        memset(shapes, 0, sizeof(zhban_shape_t *) * count);
+        return;
+    }
+
+    while (table_size < 2 * count)
+        table_size *= 2;
+
+    /* scratch layout: hash values [count], dedup table [table_size], firsts [count], missed [count] */
+    const uint32_t needed = 3 * count + table_size;
+    if (ctx->batch_allocd < needed) {
+        uint32_t *scratch = realloc(ctx->batch_scratch, sizeof(uint32_t) * needed);
+        if (!scratch) {
+            release_ctx(z, ctx);
+            memset(shapes, 0, sizeof(zhban_shape_t *) * count);
+            return;
+        }
+        ctx->batch_scratch = scratch;
+        ctx->batch_allocd = needed;
+    }
+    uint32_t *hashes = ctx->batch_scratch;
+    uint32_t *table = hashes + count;
+    uint32_t *firsts = table + table_size;  /* index of first occurence of the same string */
+    uint32_t *missed = firsts + count;      /* nonzero if it's to be shaped */
+
+    /* hash everything, find duplicates within the batch */
+    memset(table, 0xFF, sizeof(uint32_t) * table_size);
+    for (uint32_t i = 0; i < count; i++) {
+        unsigned hashv;
+        HASH_VALUE(strings[i], strsizes[i], hashv);
+        hashes[i] = hashv;
+
+        uint32_t slot = hashv & (table_size - 1);
+        while (table[slot] != BATCH_UNUSED) {
+            uint32_t j = table[slot];
+            if (hashes[j] == hashv && strsizes[j] == strsizes[i] && !memcmp(strings[j], strings[i], strsizes[i]))
+                break;
+            slot = (slot + 1) & (table_size - 1);
+        }
+        if (table[slot] == BATCH_UNUSED) {
+            table[slot] = i;
+            unique += 1;
+        }
+        firsts[i] = table[slot];
+    }
+
+    /* probe the cache for all of them at once. misses get an idle item each */
+    pthread_mutex_lock(&z->shaper_lock);
+    z->outer.shaper_gets += unique;
+    for (uint32_t i = 0; i < count; i++) {
+        if (firsts[i] != i)
+            continue;
+        shape_t *item = lookup_shape(z, strings[i], strsizes[i], hashes[i]);
+        missed[i] = !item;
+        if (item) {
+            hits += 1;
+        } else {
+            /* not inserted until all are shaped, so the space is set aside meanwhile for the next to see */
+            item = get_idle_shape(z, strsizes[i]);
+            z->shaper_reserved += shape_expected_sizeof(strsizes[i]);
+            misses += 1;
+        }
+        shapes[i] = (zhban_shape_t *)item;
+    }
+    /* duplicates are not cache hits, they are counted apart */
+    z->outer.shaper_hits += hits;
+    z->outer.batch_duplicates += count - unique;
+    pthread_mutex_unlock(&z->shaper_lock);
+
+    /* shape the misses */
+    for (uint32_t i = 0; i < count; i++) {
+        shape_t *item = (shape_t *)shapes[i];
+        if (firsts[i] != i || !missed[i])
+            continue;
+        memcpy(item->key, strings[i], strsizes[i]);
+        item->key_size = strsizes[i];
+        shape_item(z, ctx, item);
+    }
+    release_ctx(z, ctx);
+
+    if (misses) {
+        pthread_mutex_lock(&z->shaper_lock);
+        for (uint32_t i = 0; i < count; i++) {
+            shape_t *item = (shape_t *)shapes[i];
+            if (firsts[i] != i || !missed[i])
+                continue;
+            z->shaper_reserved -= shape_expected_sizeof(strsizes[i]);
+            shape_t *inserted = insert_shape(z, item, hashes[i]);
+            if (inserted != item) {
+                /* lost a race; the item is not referenced from anywhere else */
+                drop_shape(z, item);
+                shapes[i] = (zhban_shape_t *)inserted;
+            }
+        }
+        /* shapes may come out bigger than set aside; trim back to the limit with older ones */
+        shape_t *evicted;
+        while (z->outer.shaper_size > z->outer.shaper_limit && (evicted = evict_shape(z)))
+            drop_shape(z, evicted);
+        pthread_mutex_unlock(&z->shaper_lock);
+    }
+
+    /* duplicates share the first occurence, each with its own reference */
+    for (uint32_t i = 0; i < count; i++) {
+        if (firsts[i] == i)
+            continue;
+        shapes[i] = shapes[firsts[i]];
+        ZHBAN_INCREF(((shape_t *)shapes[i])->refcount);
+    }
+
+    log_trace(z, "%d strings, %d unique, %d hits, %d shaped", count, unique, hits, misses);
+}
+
+void zhban_release_shape(zhban_t *zhban, zhban_shape_t *zs) {
+    shape_t *s = (shape_t *)zs;
+
+    if (ZHBAN_GETREF(s->refcount) == 0)
+        log_fatal((zhban_internal_t *)zhban, "releasing already free shape");
+    unref_shape((zhban_internal_t *)zhban, s);
+}
+
+//}
+//{ paragraphs
+/*  A paragraph is shaped once, and lines are cut out of it: their glyphs are copied, and moved
+    so that the line starts at the origin. Where HarfBuzz says it's safe to break, that's the same
+    as shaping the line by itself; lines that start or end anywhere else are shaped anew. Glyphs are
+    looked up in the glyph cache when a line is cut, at the subpixel offset they land at.
+    Lines go into the shape cache same as any string, keyed by their text. */
+
+typedef struct _para_glyph {
+    uint32_t codepoint;     /* glyph cache glyph id */
+    int32_t  x, y;          /* pen position plus offset, 26.6 */
+    int32_t  pen_x, pen_y;  /* pen position before the glyph, 26.6 */
+    uint32_t cluster;
+    uint32_t unsafe;        /* HB_GLYPH_FLAG_UNSAFE_TO_BREAK */
+} para_glyph_t;
+
+#define PARA_NO_GLYPH UINT32_MAX
+
+struct _zhban_paragraph {
+    uint16_t *string;
+    uint32_t length;            /* in UTF-16 units */
+    para_glyph_t *glyphs;
+    uint32_t glyph_count;
+    uint32_t *cluster_glyph;    /* length + 1: first glyph of the cluster starting at each index, or PARA_NO_GLYPH */
+    int32_t pen_x, pen_y;       /* at the end */
+    uint32_t sliceable;         /* glyphs are in logical order, so those of a line are next to each other */
+};
+
+void zhban_release_paragraph(zhban_t *zhban ATTR_UNUSED, zhban_paragraph_t *para) {
+    if (!para)
+        return;
+    free(para->string);
+    free(para->glyphs);
+    free(para->cluster_glyph);
+    free(para);
+}
+
+zhban_paragraph_t *zhban_shape_paragraph(zhban_t *zhban, const uint16_t *string, const uint32_t strsize) {
+    zhban_internal_t *z = (zhban_internal_t *) zhban;
+    const uint32_t length = strsize / 2;
+    zhban_paragraph_t *rv;
+    shaper_ctx_t *ctx = NULL;
+    uint32_t allocd = 0;
+    int32_t x = 0, y = 0;
+
+    if (!(rv = calloc(1, sizeof(zhban_paragraph_t))))
+        return NULL;
+    rv->length = length;
+    rv->string = malloc((length + 1) * sizeof(uint16_t));
+    rv->cluster_glyph = malloc((length + 1) * sizeof(uint32_t));
+    if (!rv->string || !rv->cluster_glyph || !(ctx = acquire_ctx(z)))
+        goto error;
+    memcpy(rv->string, string, length * sizeof(uint16_t));
+
+    const uint32_t run_count = split_runs(z, ctx, rv->string, length);
+    const face_run_t *runs = ctx->runs;
+    const int backward = HB_DIRECTION_IS_BACKWARD(z->hb_props.direction);
+
+    for (uint32_t r = 0; r < run_count; r++) {
+        const face_run_t *run = runs + (backward ? run_count - 1 - r : r);
+        const uint32_t glyph_base = z->faces[run->face].glyph_base;
+        uint32_t glyph_count;
+
+        shape_run(z, ctx, rv->string, length, run, 0);
+        hb_glyph_info_t     *glyph_info = hb_buffer_get_glyph_infos(ctx->hb_buffer, &glyph_count);
+        hb_glyph_position_t *glyph_pos  = hb_buffer_get_glyph_positions(ctx->hb_buffer, &glyph_count);
+
+        if (rv->glyph_count + glyph_count > allocd) {
+            para_glyph_t *glyphs = realloc(rv->glyphs, (rv->glyph_count + glyph_count) * sizeof(para_glyph_t));
+            if (!glyphs)
+                goto error;
+            rv->glyphs = glyphs;
+            allocd = rv->glyph_count + glyph_count;
+        }
+        for (uint32_t j = 0; j < glyph_count; j++) {
+            para_glyph_t *g = rv->glyphs + rv->glyph_count++;
+            g->codepoint = glyph_base + glyph_info[j].codepoint;
+            g->pen_x = x;
+            g->pen_y = y;
+            g->x = x + glyph_pos[j].x_offset;
+            g->y = y + glyph_pos[j].y_offset;
+            g->cluster = glyph_info[j].cluster;
+            g->unsafe = hb_glyph_info_get_glyph_flags(glyph_info + j) & HB_GLYPH_FLAG_UNSAFE_TO_BREAK;
+            x += glyph_pos[j].x_advance;
+            y += glyph_pos[j].y_advance;
+        }
+    }
+    release_ctx(z, ctx);
+    rv->pen_x = x;
+    rv->pen_y = y;
+    rv->sliceable = !backward;
+
+    for (uint32_t i = 0; i < length; i++)
+        rv->cluster_glyph[i] = PARA_NO_GLYPH;
+    for (uint32_t i = rv->glyph_count; i > 0; i--)
+        rv->cluster_glyph[rv->glyphs[i - 1].cluster] = i - 1;
+    rv->cluster_glyph[length] = rv->glyph_count;
+    return rv;
+
+    error:
+    log_error(z, "out of memory or shaping context");
+    if (ctx)
+        release_ctx(z, ctx);
+    zhban_release_paragraph(zhban, rv);
+    return NULL;
+}
+
+/* cuts the line, the item's key, at 'line' in the paragraph's string, out of it. nonzero if it can't be */
+static int slice_line(zhban_internal_t *z, shaper_ctx_t *ctx, const zhban_paragraph_t *para, shape_t *item,
+                                                                                        const uint16_t *line) {
+    const uint32_t start = line - para->string;
+    const uint32_t end = start + item->key_size / 2;
+    const uint32_t g0 = para->cluster_glyph[start], g1 = para->cluster_glyph[end];
+    extents_t e;
+
+    if (!para->sliceable || g0 == PARA_NO_GLYPH || g1 == PARA_NO_GLYPH || g1 < g0
+            || (start > 0 && start < para->length && para->glyphs[g0].unsafe)
+            || (end < para->length && para->glyphs[g1].unsafe)) {
+        ZHBAN_STAT_ADD(z->outer.paragraph_reshaped, 1);
+        return 1;
+    }
+
+    const int32_t base_x = g0 < para->glyph_count ? para->glyphs[g0].pen_x : para->pen_x;
+    const int32_t base_y = g0 < para->glyph_count ? para->glyphs[g0].pen_y : para->pen_y;
+    const int32_t end_x = g1 < para->glyph_count ? para->glyphs[g1].pen_x : para->pen_x;
+    const int32_t end_y = g1 < para->glyph_count ? para->glyphs[g1].pen_y : para->pen_y;
+
+    start_shape(item, &e);
+    for (uint32_t i = g0; i < g1; i++) {
+        const para_glyph_t *pg = para->glyphs + i;
+        int32_t gx = pg->x - base_x, gy = pg->y - base_y;
+        glyph_t *glyph;
+
+        if (z->subpixel_positioning) {
+            gx = snap_phase(gx, z->phases_x);
+            gy = snap_phase(gy, z->phases_y);
+        }
+        if ((glyph = get_a_glyph(z, ctx, pg->codepoint, gx & 0x3f, gy & 0x3f)))
+            place_glyph(z, item, &e, glyph, gx, gy, pg->cluster - start);
+    }
+    /* same as shape_string() would have it: flags are about breaking before a glyph */
+    int cut = 0;
+    for (uint32_t i = g0; i < g1; i++) {
+        if (para->glyphs[i].cluster != start) {
+            cut = 1;
+            if (para->glyphs[i].unsafe)
+                item->unsafe |= SHAPE_UNSAFE_INSIDE;
+        }
+    }
+    if (!cut)
+        item->unsafe |= SHAPE_UNSAFE_INSIDE;
+    finish_shape(z, item, &e, end_x - base_x, end_y - base_y);
+    ZHBAN_STAT_ADD(z->outer.paragraph_lines, 1);
+    return 0;
+}
 
-    item->bitmap.cluster_map = item->bitmap.data + sh->shape.w * sh->shape.h;
-    item->bitmap.data_size = sh->shape.w * sh->shape.h * 4;
+zhban_shape_t *zhban_paragraph_line(zhban_t *zhban, zhban_paragraph_t *para, uint32_t start, uint32_t end) {
+    zhban_internal_t *z = (zhban_internal_t *) zhban;
+    unsigned hashv;
+
+    if (start > end || end > para->length) {
+        log_error(z, "line %d..%d out of paragraph of %d", start, end, para->length);
+        return NULL;
+    }
+    HASH_VALUE(para->string + start, (end - start) * 2, hashv);
+    return shape_hashed(z, para->string + start, (end - start) * 2, hashv, para);
+}
+
+//}
+//{ interned strings
+/*  Strings shaped over and over, like UI labels, are hashed and copied once, in zhban_intern(),
+    and looked up in the shape cache by that hash afterwards. The table is keyed by content,
+    so interning the same string twice gives the same handle, refcounted under intern_lock.
+    Lookups compare the 32-bit hash and the size before the string itself. */
+struct _intern {
+    zhban_handle_t handle;  /* first, the public part */
+    uint32_t refs;          /* under intern_lock */
+    UT_hash_handle hh;
+    uint16_t string[];
+};
+
+zhban_handle_t *zhban_intern(zhban_t *zhban, const uint16_t *string, const uint32_t strsize) {
+    zhban_internal_t *z = (zhban_internal_t *)zhban;
+    uint64_t hash = hash_bytes(string, strsize);
+    intern_t *item;
+
+    pthread_mutex_lock(&z->intern_lock);
+    HASH_FIND_BYHASHVALUE(hh, z->interned, string, strsize, hash_fold(hash), item);
+    if (item) {
+        item->refs += 1;
+        pthread_mutex_unlock(&z->intern_lock);
+        return &item->handle;
+    }
+    if (!(item = malloc(sizeof(intern_t) + strsize))) {
+        pthread_mutex_unlock(&z->intern_lock);
+        log_error(z, "malloc(%d) failed", (int)(sizeof(intern_t) + strsize));
+        return NULL;
+    }
+    memcpy(item->string, string, strsize);
+    item->handle.string = item->string;
+    item->handle.size = strsize;
+    item->handle.hash = hash;
+    item->refs = 1;
+    HASH_ADD_KEYPTR_BYHASHVALUE(hh, z->interned, item->string, strsize, hash_fold(hash), item);
+    pthread_mutex_unlock(&z->intern_lock);
+
+    return &item->handle;
+}
+
+zhban_shape_t *zhban_shape_handle(zhban_t *zhban, const zhban_handle_t *handle) {
+    return shape_hashed((zhban_internal_t *)zhban, handle->string, handle->size, hash_fold(handle->hash), NULL);
+}
+
+void zhban_release_handle(zhban_t *zhban, zhban_handle_t *handle) {
+    zhban_internal_t *z = (zhban_internal_t *)zhban;
+    intern_t *item = (intern_t *)handle;
+
+    pthread_mutex_lock(&z->intern_lock);
+    if (item->refs == 0)
+        log_fatal(z, "releasing already free handle");
+    else if (--item->refs == 0) {
+        HASH_DELETE(hh, z->interned, item);
+        free(item);
+    }
+    pthread_mutex_unlock(&z->intern_lock);
+}
+
+static void drop_interned(zhban_internal_t *z) {
+    intern_t *item, *tmp;
+
+    HASH_ITER(hh, z->interned, item, tmp) {
+        HASH_DELETE(hh, z->interned, item);
+        free(item);
+    }
+}
+
+//}
+//{ prewarm
+/*  Filling glyph and shape caches ahead of time. Done either right in the call, or queued
+    for a thread of its own, started on first use, that runs at idle priority where the
+    system has one, and otherwise yields between items. A job is a copy of what it was
+    given, so the caller need not keep anything around. */
+
+/* subpixel variants of each glyph prewarmed, at most. more phases than that get phase 0 only */
+#define PREWARM_MAX_VARIANTS 16
+
+struct _prewarm_job {
+    uint32_t *ranges;       /* pairs of first and last codepoint */
+    uint32_t range_count;
+    uint16_t **strings;
+    uint32_t *strsizes;
+    uint32_t string_count;
+    struct _prewarm_job *next;
+};
+
+static void prewarm_glyphs(zhban_internal_t *z, const uint32_t *ranges, uint32_t count, uint32_t yield) {
+    uint32_t px = 1, py = 1;
+    shaper_ctx_t *ctx;
+
+    if (z->subpixel_positioning && z->phases_x * z->phases_y <= PREWARM_MAX_VARIANTS) {
+        px = z->phases_x;
+        py = z->phases_y;
+    }
+    if (!(ctx = acquire_ctx(z))) {
+        for (uint32_t i = 0; i < count; i++)
+            ZHBAN_STAT_ADD(z->outer.prewarm_done, ranges[2 * i + 1] - ranges[2 * i] + 1);
+        return;
+    }
+    for (uint32_t i = 0; i < count && !z->warm_quit; i++) {
+        for (uint32_t cp = ranges[2 * i]; cp <= ranges[2 * i + 1] && !z->warm_quit; cp++) {
+            uint32_t gid = char_glyph(z, ctx, cp);
+            for (uint32_t x = 0; gid && x < px; x++)
+                for (uint32_t y = 0; y < py; y++) {
+                    glyph_t *glyph = get_a_glyph(z, ctx, gid, phase_offset(x, px), phase_offset(y, py));
+                    if (glyph)
+                        unref_glyph(z, glyph);
+                }
+            ZHBAN_STAT_ADD(z->outer.prewarm_done, 1);
+            if (yield)
+                sched_yield();
+        }
+    }
+    release_ctx(z, ctx);
+}
+
+static void prewarm_strings(zhban_internal_t *z, const uint16_t **strings, const uint32_t *strsizes,
+                                                                uint32_t count, uint32_t yield) {
+    for (uint32_t i = 0; i < count && !z->warm_quit; i++) {
+        zhban_shape_t *shape = zhban_shape((zhban_t *)z, strings[i], strsizes[i]);
+        if (shape)
+            zhban_release_shape((zhban_t *)z, shape);
+        ZHBAN_STAT_ADD(z->outer.prewarm_done, 1);
+        if (yield)
+            sched_yield();
+    }
+}
+
+static void *warmer(void *arg) {
+    zhban_internal_t *z = (zhban_internal_t *)arg;
+    prewarm_job_t *job;
+
+    pthread_mutex_lock(&z->warm_lock);
+    while (!z->warm_quit) {
+        if (!(job = z->warm_jobs)) {
+            pthread_cond_wait(&z->warm_cond, &z->warm_lock);
+            continue;
+        }
+        z->warm_jobs = job->next;
+        z->warm_busy = 1;
+        pthread_mutex_unlock(&z->warm_lock);
+
+        prewarm_glyphs(z, job->ranges, job->range_count, 1);
+        prewarm_strings(z, (const uint16_t **)job->strings, job->strsizes, job->string_count, 1);
+        free(job);
+
+        pthread_mutex_lock(&z->warm_lock);
+        z->warm_busy = 0;
+        if (!z->warm_jobs)
+            pthread_cond_broadcast(&z->warm_idle);
+    }
+    pthread_cond_broadcast(&z->warm_idle);
+    pthread_mutex_unlock(&z->warm_lock);
+    return NULL;
+}
+
+/* queues the job, starting the warmer thread if it's not running yet. nonzero on error */
+static int queue_prewarm(zhban_internal_t *z, prewarm_job_t *job) {
+    int rv = 0;
+
+    pthread_mutex_lock(&z->warm_lock);
+    if (!z->warm_started) {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+#if defined(SCHED_IDLE)
+        struct sched_param param = { .sched_priority = 0 };
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_IDLE);
+        pthread_attr_setschedparam(&attr, &param);
+#endif
+        /* if idle priority is not allowed, go with the default */
+        if (pthread_create(&z->warm_thread, &attr, warmer, z) && pthread_create(&z->warm_thread, NULL, warmer, z)) {
+            log_error(z, "can't start the warmer thread");
+            rv = 1;
+        }
+        pthread_attr_destroy(&attr);
+        z->warm_started = !rv;
+    }
+    if (!rv) {
+        prewarm_job_t **tail = &z->warm_jobs;
+        while (*tail)
+            tail = &(*tail)->next;
+        *tail = job;
+        pthread_cond_signal(&z->warm_cond);
+    }
+    pthread_mutex_unlock(&z->warm_lock);
+    return rv;
+}
+
+static void stop_warmer(zhban_internal_t *z) {
+    pthread_mutex_lock(&z->warm_lock);
+    z->warm_quit = 1;
+    pthread_cond_signal(&z->warm_cond);
+    pthread_cond_broadcast(&z->warm_idle);
+    pthread_mutex_unlock(&z->warm_lock);
+    if (z->warm_started)
+        pthread_join(z->warm_thread, NULL);
+    z->warm_started = 0;
+    while (z->warm_jobs) {
+        prewarm_job_t *job = z->warm_jobs;
+        z->warm_jobs = job->next;
+        free(job);
+    }
+}
+
+int zhban_prewarm_codepoints(zhban_t *zhban, const uint32_t *ranges, uint32_t count, uint32_t background) {
+    zhban_internal_t *z = (zhban_internal_t *)zhban;
+    prewarm_job_t *job;
+    uint32_t total = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (ranges[2 * i] > ranges[2 * i + 1] || ranges[2 * i + 1] > 0x10FFFF) {
+            log_error(z, "bad range %d: %x to %x", i, ranges[2 * i], ranges[2 * i + 1]);
+            return 1;
+        }
+        total += ranges[2 * i + 1] - ranges[2 * i] + 1;
+    }
+    ZHBAN_STAT_ADD(z->outer.prewarm_queued, total);
+    if (!background) {
+        prewarm_glyphs(z, ranges, count, 0);
+        return 0;
+    }
+
+    if (!(job = calloc(1, sizeof(prewarm_job_t) + 2 * sizeof(uint32_t) * count))) {
+        log_error(z, "calloc() failed");
+        ZHBAN_STAT_ADD(z->outer.prewarm_done, total);
+        return 1;
+    }
+    job->ranges = (uint32_t *)(job + 1);
+    job->range_count = count;
+    memcpy(job->ranges, ranges, 2 * sizeof(uint32_t) * count);
+    if (queue_prewarm(z, job)) {
+        free(job);
+        ZHBAN_STAT_ADD(z->outer.prewarm_done, total);
+        return 1;
+    }
+    return 0;
+}
+
+int zhban_prewarm_strings(zhban_t *zhban, const uint16_t **strings, const uint32_t *strsizes, uint32_t count,
+                                                                                        uint32_t background) {
+    zhban_internal_t *z = (zhban_internal_t *)zhban;
+    prewarm_job_t *job;
+    size_t size = sizeof(prewarm_job_t) + (sizeof(uint16_t *) + sizeof(uint32_t)) * count;
+    char *copy;
+
+    ZHBAN_STAT_ADD(z->outer.prewarm_queued, count);
+    if (!background) {
+        prewarm_strings(z, strings, strsizes, count, 0);
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+        size += strsizes[i];
+    if (!(job = calloc(1, size))) {
+        log_error(z, "calloc(%d) failed", (int)size);
+        ZHBAN_STAT_ADD(z->outer.prewarm_done, count);
+        return 1;
+    }
+    /* pointers first, they need the alignment */
+    job->strings = (uint16_t **)(job + 1);
+    job->strsizes = (uint32_t *)(job->strings + count);
+    job->string_count = count;
+    copy = (char *)(job->strsizes + count);
+    for (uint32_t i = 0; i < count; i++) {
+        job->strings[i] = (uint16_t *)copy;
+        job->strsizes[i] = strsizes[i];
+        memcpy(copy, strings[i], strsizes[i]);
+        copy += strsizes[i];
+    }
+    if (queue_prewarm(z, job)) {
+        free(job);
+        ZHBAN_STAT_ADD(z->outer.prewarm_done, count);
+        return 1;
+    }
+    return 0;
+}
+
+uint32_t zhban_prewarm_pending(zhban_t *zhban) {
+    /* done first: it never gets ahead of queued */
+    const uint32_t done = __atomic_load_n(&zhban->prewarm_done, __ATOMIC_ACQUIRE);
+    const uint32_t queued = __atomic_load_n(&zhban->prewarm_queued, __ATOMIC_ACQUIRE);
+
+    return queued - done;
+}
+
+void zhban_prewarm_wait(zhban_t *zhban) {
+    zhban_internal_t *z = (zhban_internal_t *)zhban;
+
+    pthread_mutex_lock(&z->warm_lock);
+    while (!z->warm_quit && (z->warm_jobs || z->warm_busy))
+        pthread_cond_wait(&z->warm_idle, &z->warm_lock);
+    pthread_mutex_unlock(&z->warm_lock);
+}
+
+//}
+//{ bitmap_t
+/* bitmap cache key: the shape, and which post-processed variant of it.
+   hashed as bytes, so always memset() before filling in. */
+typedef struct _bitmap_key {
+    shape_t *shape;         /* out there in the shaper, refcounted */
+    zhban_postproc_t pp;    /* NULL for the raw RG16 render */
+    uint32_t format;        /* ZHBAN_FORMAT_* */
+    uint64_t tag;           /* post-processor parameter, see default_tag(), or the color */
+} bitmap_key_t;
+
+struct _bitmap {
+    zhban_bitmap_t bitmap;
+
+    bitmap_key_t key;
+    bitmap_t *source;     /* raw render to derive this variant from. zhban_render_batch() only */
+
+    uint32_t data_allocd;
+    uint32_t pinned;      /* part of a zhban_render_batch() in progress, not to be evicted */
+    uint32_t segment;     /* CACHE_* */
+
+    UT_hash_handle hh;
+    struct _bitmap *prev;
+    struct _bitmap *next;
+};
+
+static inline uint32_t bitmap_hashv(const bitmap_t *p) {
+    return p->hh.hashv;
+}
+
+static uint32_t bitmap_sizeof(const bitmap_t *p) {
+    return sizeof(bitmap_t) + p->data_allocd;
+}
+
+static inline int format_is_r8(const uint32_t format) {
+    return format == ZHBAN_FORMAT_R8 || format == ZHBAN_FORMAT_R8_CLUSTERS;
+}
+
+/* pixels, padded so that the cluster map that follows is aligned */
+static uint32_t bitmap_pixels_size(const shape_t *zs, const uint32_t format) {
+    return (zs->shape.w * zs->shape.h * (format_is_r8(format) ? 1 : 4) + 3) & ~3u;
+}
+
+static uint32_t bitmap_data_expected_size(const shape_t *zs, const uint32_t format) {
+    /* FIXME for vertical scripts - cluster map strip */
+    uint32_t size = bitmap_pixels_size(zs, format) + zs->shape.w * 4;
+    if (format == ZHBAN_FORMAT_R8_CLUSTERS)
+        size += zs->shape.w * zs->shape.h * 2;
+    return size;
+}
+
+static uint32_t bitmap_expected_sizeof(const shape_t *shape, const uint32_t format) {
+    return sizeof(bitmap_t) + bitmap_data_expected_size(shape, format);
+}
+
+/* points zhban_bitmap_t fields into the data buffer: pixels, cluster map row, cluster plane */
+static void layout_bitmap(bitmap_t *item) {
+    const shape_t *sh = item->key.shape;
+    const uint32_t format = item->key.format;
+    const uint32_t pixels_size = bitmap_pixels_size(sh, format);
+
+    item->bitmap.format = format;
+    item->bitmap.data_size = sh->shape.w * sh->shape.h * (format_is_r8(format) ? 1 : 4);
+    item->bitmap.cluster_map = (uint32_t *)((uint8_t *)item->bitmap.data + pixels_size);
     item->bitmap.cluster_map_size = sh->shape.w * 4;
+    if (format == ZHBAN_FORMAT_R8_CLUSTERS) {
+        item->bitmap.cluster_plane = (uint16_t *)(item->bitmap.cluster_map + sh->shape.w);
+        item->bitmap.cluster_plane_size = sh->shape.w * sh->shape.h * 2;
+    } else {
+        item->bitmap.cluster_plane = NULL;
+        item->bitmap.cluster_plane_size = 0;
+    }
+}
+
+static bitmap_t *reallocate_bitmap(zhban_internal_t *z, const shape_t *shape, const uint32_t format, bitmap_t *bitmap) {
+    if (!bitmap) {
+        bitmap = malloc(sizeof(bitmap_t));
+        memset(bitmap, 0, sizeof(bitmap_t));
+    } else {
+        if (bitmap->key.shape) {
+            unref_shape(z, bitmap->key.shape);
+            bitmap->key.shape = NULL;
+        }
+    }
+    uint32_t data_size = bitmap_data_expected_size(shape, format);
+    if (bitmap->data_allocd < data_size) {
+        bitmap->data_allocd = data_size;
+        bitmap->bitmap.data = realloc(bitmap->bitmap.data, bitmap->data_allocd);
+    } else if (data_size && data_size < bitmap->data_allocd / 2) {
+        /* a buffer from a larger string or format counts against bitmap_limit in full, so give back the slack */
+        void *data = realloc(bitmap->bitmap.data, data_size);
+        if (data) {
+            bitmap->bitmap.data = data;
+            bitmap->data_allocd = data_size;
+        }
+    }
+    return bitmap;
+}
+
+static void drop_bitmap(zhban_internal_t *z, bitmap_t *b) {
+    if (b->key.shape)
+        unref_shape(z, b->key.shape);
+    free(b->bitmap.data);
+    free(b);
+}
+
+static void drop_bitmap_cache(zhban_internal_t *z, bitmap_t **head) {
+    bitmap_t *elt, *tmp;
+    HASH_ITER(hh, *head, elt, tmp) {
+        HASH_DEL(*head, elt);
+        drop_bitmap(z, elt);
+    }
+}
+
+/* return a shape_t that can be (re)used for a given key_size minding cache size limit. */
+static bitmap_t *get_idle_bitmap(zhban_internal_t *z, const shape_t *shape, const uint32_t format) {
+    bitmap_t *item, *evicted_item = NULL, *tmp;
+    uint32_t needed_space = bitmap_expected_sizeof(shape, format);
+
+    /* if we are over the cache size limit, clean up some, probation list first. */
+    for (int pass = 0; pass < 2; pass++) {
+        DL_FOREACH_SAFE(pass ? z->bitmap_protected : z->bitmap_history, item, tmp) {
+            /* ignore ones handed out by the current batch */
+            if (item->pinned)
+                continue;
+
+            /* if we have enough space at last .. */
+            if (z->outer.bitmap_size + needed_space < z->outer.bitmap_limit)
+                break;
+
+            /* drop evicted item if we need to evict more that one */
+            if(evicted_item)
+                drop_bitmap(z, evicted_item);
+
+            HASH_DELETE(hh, z->bitmap_cache, item);
+            CACHE_UNLINK(&z->bitmap_policy, z->bitmap_history, z->bitmap_protected, item, bitmap_sizeof);
+            z->outer.bitmap_size -= bitmap_sizeof(item);
+            z->outer.bitmap_evictions += 1;
+            evicted_item = item;
+        }
+    }
+
+    /* got one by eviction: reuse it so as to not do free/alloc dance,
+       otherwise reallocate_bitmap() will allocate a new item */
+    bitmap_t *rv = reallocate_bitmap(z, shape, format, evicted_item);
+
+    /* grow cache to avoid thrashing (?) */
+    if (z->outer.bitmap_limit < z->outer.bitmap_size) {
+        log_trace(z, "grew cache from %d to %d", z->outer.bitmap_limit, z->outer.bitmap_size);
+        z->outer.bitmap_limit = z->outer.bitmap_size;
+    }
+
+    return rv;
+}
+
+void zhban_set_cache_policy(zhban_t *zhban, uint32_t policy) {
+    zhban_internal_t *z = (zhban_internal_t *)zhban;
+
+    if (policy > ZHBAN_CACHE_TINYLFU) {
+        log_error(z, "unknown cache policy %d", policy);
+        return;
+    }
+
+    /* LRU has no use for the protected lists */
+    const uint32_t cap = policy == ZHBAN_CACHE_LRU ? 0 : UINT32_MAX;
+    for (int i = 0; i < GLYPH_SHARDS; i++) {
+        glyph_shard_t *shard = z->glyph_shards + i;
+        pthread_mutex_lock(&shard->lock);
+        policy_setup(&shard->policy, policy, shard->limit);
+        CACHE_DEMOTE(&shard->policy, shard->history, shard->protected, glyph_sizeof, cap);
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    pthread_mutex_lock(&z->shaper_lock);
+    policy_setup(&z->shaper_policy, policy, z->outer.shaper_limit);
+    CACHE_DEMOTE(&z->shaper_policy, z->shaper_history, z->shaper_protected, shape_sizeof, cap);
+    pthread_mutex_unlock(&z->shaper_lock);
+
+    policy_setup(&z->bitmap_policy, policy, z->outer.bitmap_limit);
+    CACHE_DEMOTE(&z->bitmap_policy, z->bitmap_history, z->bitmap_protected, bitmap_sizeof, cap);
+
+    /* so that hit rates are those of this policy. shaping threads may be counting meanwhile */
+    ZHBAN_STAT_SET(z->outer.glyph_gets, 0);
+    ZHBAN_STAT_SET(z->outer.glyph_hits, 0);
+    ZHBAN_STAT_SET(z->outer.glyph_evictions, 0);
+    ZHBAN_STAT_SET(z->outer.shaper_gets, 0);
+    ZHBAN_STAT_SET(z->outer.shaper_hits, 0);
+    ZHBAN_STAT_SET(z->outer.shaper_evictions, 0);
+    ZHBAN_STAT_SET(z->outer.bitmap_gets, 0);
+    ZHBAN_STAT_SET(z->outer.bitmap_hits, 0);
+    ZHBAN_STAT_SET(z->outer.bitmap_evictions, 0);
+    ZHBAN_STAT_SET(z->outer.cache_promotions, 0);
+    ZHBAN_STAT_SET(z->outer.cache_rejections, 0);
+    ZHBAN_STAT_SET(z->outer.cache_policy, policy);
+}
+
+//}
+//{ renderer
+/* composites a run of len pixels starting at index 'at'. pixel values as in render_shape() */
+static inline void put_span(zhban_internal_t *z, bitmap_t *item, int32_t at, uint32_t len, uint8_t *r8,
+                    uint16_t coverage, uint32_t keep, uint32_t attr, uint32_t shift, uint32_t cluster) {
+    if (r8) {
+        z->blit->span8(r8 + at, len, coverage & 0xFF);
+        if (item->bitmap.cluster_plane)
+            z->blit->fill16(item->bitmap.cluster_plane + at, len, cluster);
+    } else {
+        z->blit->span(item->bitmap.data + at, len, keep, attr | (uint32_t)coverage << shift);
+    }
+}
+
+static inline void put_tile_row(zhban_internal_t *z, bitmap_t *item, int32_t at, uint32_t len, uint8_t *r8,
+                    const uint8_t *src, uint32_t keep, uint32_t attr, uint32_t shift, uint32_t cluster) {
+    if (r8) {
+        z->blit->tile_row8(r8 + at, src, len);
+        if (item->bitmap.cluster_plane)
+            z->blit->tile_row16(item->bitmap.cluster_plane + at, src, len, cluster);
+    } else {
+        z->blit->tile_row(item->bitmap.data + at, src, len, keep, attr, shift);
+    }
+}
+
+/* color for the premultiplied formats, channels in memory order */
+static uint32_t format_color(const uint32_t format, const uint32_t color) {
+    if (format == ZHBAN_FORMAT_BGRA8)
+        return (color & 0x0000FF00u) | (color & 0xFFu) << 16 | (color >> 16 & 0xFFu);
+    return color & 0x00FFFFFFu;
+}
+
+/* renders in the item's format. for RG16, if color is given, renders RGBA8 same as zhban_pp_color()
+   would convert it to, and flip puts the top row first, as zhban_pp_color_vflip() does. */
+static void render_shape(zhban_internal_t *z, bitmap_t *item, const uint32_t *color, int flip) {
+    shape_t *sh = item->key.shape;
+    const uint32_t format = item->key.format;
+
+    memset(item->bitmap.data, 0, bitmap_data_expected_size(sh, format));
+    layout_bitmap(item);
+
+    /* R8 formats are rendered as is, premultiplied ones are rendered R8 into
+       the last quarter of the buffer first, and expanded in place afterwards */
+    uint8_t *r8 = NULL;
+    if (format_is_r8(format))
+        r8 = (uint8_t *)item->bitmap.data;
+    else if (format != ZHBAN_FORMAT_RG16)
+        r8 = (uint8_t *)item->bitmap.data + sh->shape.w * sh->shape.h * 3;
+
+    /* pixel indices. flipping is just walking rows the other way round */
+    const  int32_t  pitch = flip ? -sh->shape.w : sh->shape.w;  /* must be signed, or hilarity ensues */
+    const  int32_t  bottom_row = flip ? sh->shape.w * (sh->shape.h - 1) : 0;
+    const  int32_t  pixel_count = sh->shape.w * sh->shape.h;
 
     int x_cmlimit;
     const uint32_t glyph_count =  sh->glyphs_used/sizeof(glyph_info_t);
 
-    log_trace(z, "renderering into %dx%d origin %d,%d shape %p",
-                sh->shape.w, sh->shape.h, sh->shape.origin_x, sh->shape.origin_y, sh);
+    log_trace(z, "renderering into %dx%d origin %d,%d shape %p format %d",
+                sh->shape.w, sh->shape.h, sh->shape.origin_x, sh->shape.origin_y, sh, format);
 
     for (uint32_t glyph_i = 0; glyph_i < glyph_count; glyph_i++) {
         glyph_info_t *g_info = sh->glyphs + glyph_i;
         glyph_t *glyph = g_info->glyph;
 
-        const uint32_t span_count = glyph->spans_used/sizeof(span_t);
+        const uint32_t span_count = glyph_span_count(glyph);
 
         /* FIXME: pixel format, endianness */
-        const uint32_t attribute_shifted = (g_info->cluster & 0xFFFFu)<<16;
-        const uint32_t attribute_mask = 0x0000FFFFU;
+        const uint32_t cluster = g_info->cluster & 0xFFFFu;
+        const uint32_t attribute_shifted = color ? *color & 0x00FFFFFFu : cluster << 16;
+        const uint32_t attribute_mask = color ? 0xFF000000u : 0x0000FFFFU;
+        const uint32_t coverage_shift = color ? 24 : 0;
 
         int32_t gx = g_info->x_origin >> 6; /* translate */
         int32_t gy = g_info->y_origin >> 6; /* to pixels */
-        uint32_t *origin = item->bitmap.data + pitch * gy + gx;
+        int32_t origin = bottom_row + pitch * gy + gx;
 
         log_trace(z, "rendering glyph %d at  %d,%d", glyph_i, gx, gy);
 
+        if (glyph->tiled) {
+            const uint32_t tile_w = glyph_tile_w(glyph), tile_h = glyph_tile_h(glyph);
+            const uint8_t *src = glyph_tile(glyph);
+            int32_t start = origin + glyph->min_y * pitch + glyph->min_span_x;
+            int32_t end = start + (int32_t)(tile_h - 1) * pitch;
+
+            if ((start < end ? start : end) < 0 || (start < end ? end : start) + (int32_t)tile_w > pixel_count) {
+                log_error(z, "  error: tile out of bounds (origin=%d start=%d end=%d pixels=%d)", origin, start, end, pixel_count);
+                log_info(z,  "  tile %dx%d at %d,%d", tile_w, tile_h, gx + glyph->min_span_x, gy + glyph->min_y);
+            } else {
+                for (uint32_t row = 0; row < tile_h; row++, start += pitch, src += tile_w)
+                    put_tile_row(z, item, start, tile_w, r8, src, attribute_mask, attribute_shifted, coverage_shift, cluster);
+            }
+        }
+
         for (uint32_t span_i = 0; span_i < span_count; span_i++) {
-            span_t   *span = glyph->spans + span_i;
-            uint32_t *start = origin + span->y * pitch + span->x;
-
-            if (start >= first_pixel) {
-                if (start + span->len <= last_pixel) {
-                    for (int x = 0; x < span->len; x++) {
-                        /* FIXME: pixel format, endianness */
-                        uint32_t t = *start & attribute_mask;
-                        t |= attribute_shifted | span->coverage;
-                        *start++ = t;
-                    }
-                } else {
-                    log_error(z, "  error: overflow (origin=%p start=%p fp=%p lp=%p )", origin, start, first_pixel, last_pixel);
-                    log_info(z,  "  span %d x [%d,%d] y %d | abs [%d,%d] y %d", span_i, span->x, span->x + span->len, span->y,
-                            gx + span->x, gx + span->x + span->len, gy + span->y);
-                }
+            span_t   *span = glyph_spans(glyph) + span_i;
+            int32_t   start = origin + span->y * pitch + span->x;
+
+            if (start >= 0 && start + span->len <= pixel_count) {
+                put_span(z, item, start, span->len, r8, span->coverage, attribute_mask, attribute_shifted, coverage_shift, cluster);
             } else {
-                log_error(z, "  error: underflow (origin=%p start=%p fp=%p lp=%p )", origin, start, first_pixel, last_pixel);
+                log_error(z, "  error: span out of bounds (origin=%d start=%d pixels=%d)", origin, start, pixel_count);
                 log_info(z,  "  span %d x [%d,%d] y %d | abs [%d,%d] y %d", span_i, span->x, span->x + span->len, span->y,
                         gx + span->x, gx + span->x + span->len, gy + span->y);
             }
@@ -1045,74 +3653,620 @@ static void render_shape(zhban_internal_t *z, bitmap_t *item) {
         for (int32_t cj = g_info->x_origin>>6; cj < x_cmlimit; cj++)
             item->bitmap.cluster_map[cj] = g_info->cluster;
     }
+
+    /* the color comes in the key tag, see make_key() */
+    if (r8 && !format_is_r8(format))
+        z->blit->premultiply(item->bitmap.data, r8, pixel_count, format_color(format, (uint32_t)item->key.tag));
 }
 
-zhban_bitmap_t *zhban_render_pp(zhban_t *zhban, zhban_shape_t *zshape, zhban_postproc_t pp, void *u) {
-    zhban_internal_t *z = (zhban_internal_t *)zhban;
-    shape_t *shape = (shape_t *)zshape;
+/* builtin color post-processors get fused into rendering, so the bitmap is written once */
+static void render_shape_pp(zhban_internal_t *z, bitmap_t *item, zhban_postproc_t pp, void *u) {
+    if (pp == zhban_pp_color) {
+        render_shape(z, item, (const uint32_t *)u, 0);
+    } else if (pp == zhban_pp_color_vflip) {
+        render_shape(z, item, (const uint32_t *)u, 1);
+    } else {
+        render_shape(z, item, NULL, 0);
+        if (pp)
+            pp((zhban_bitmap_t *)item, (zhban_shape_t *)item->key.shape, u);
+    }
+}
+
+/* converts the raw render into one of the compact formats */
+static void derive_format(zhban_internal_t *z, bitmap_t *item, const bitmap_t *source) {
+    const shape_t *sh = item->key.shape;
+    const uint32_t format = item->key.format;
+    const uint32_t count = sh->shape.w * sh->shape.h;
+    uint8_t *r8 = (uint8_t *)item->bitmap.data + (format_is_r8(format) ? 0 : count * 3);
+
+    for (uint32_t i = 0; i < count; i++)
+        r8[i] = source->bitmap.data[i] & 0xFF;
+    if (item->bitmap.cluster_plane)
+        for (uint32_t i = 0; i < count; i++)
+            item->bitmap.cluster_plane[i] = source->bitmap.data[i] >> 16;
+    memcpy(item->bitmap.cluster_map, source->bitmap.cluster_map, sh->shape.w * 4);
+
+    if (!format_is_r8(format))
+        z->blit->premultiply(item->bitmap.data, r8, count, format_color(format, (uint32_t)item->key.tag));
+}
+
+/* makes a post-processed or converted variant out of the raw render instead of rendering it again */
+static void derive_bitmap(zhban_internal_t *z, bitmap_t *item, const bitmap_t *source, zhban_postproc_t pp, void *u) {
+    const shape_t *sh = item->key.shape;
+    const uint32_t w = sh->shape.w, h = sh->shape.h;
+
+    layout_bitmap(item);
+    if (item->key.format != ZHBAN_FORMAT_RG16) {
+        derive_format(z, item, source);
+        return;
+    }
+
+    if (pp == zhban_pp_color_vflip) {
+        for (uint32_t y = 0; y < h; y++)
+            memcpy(item->bitmap.data + w * (h - y - 1), source->bitmap.data + w * y, w * 4);
+        memcpy(item->bitmap.cluster_map, source->bitmap.cluster_map, w * 4);
+    } else {
+        memcpy(item->bitmap.data, source->bitmap.data, w * (h + 1) * 4);
+    }
+
+    if (pp == zhban_pp_color || pp == zhban_pp_color_vflip)
+        z->blit->colorize(item->bitmap.data, w * h, *(const uint32_t *)u & 0x00FFFFFFu);
+    else
+        pp((zhban_bitmap_t *)item, (zhban_shape_t *)item->key.shape, u);
+}
+
+static void make_key(bitmap_key_t *key, shape_t *shape, zhban_postproc_t pp, uint64_t tag, uint32_t format) {
+    memset(key, 0, sizeof(bitmap_key_t));
+    key->shape = shape;
+    key->pp = pp;
+    key->format = format;
+    key->tag = (pp || format == ZHBAN_FORMAT_RGBA8 || format == ZHBAN_FORMAT_BGRA8) ? tag : 0;
+}
+
+/* variant tag when none is given: the color for the builtin post-processors, the parameter pointer otherwise */
+static uint64_t default_tag(zhban_postproc_t pp, void *u) {
+    if (u && (pp == zhban_pp_color || pp == zhban_pp_color_vflip))
+        return *(const uint32_t *)u & 0x00FFFFFFu;
+    return (uintptr_t)u;
+}
+
+static bitmap_t *find_bitmap(zhban_internal_t *z, const bitmap_key_t *key) {
     bitmap_t *item;
-    z->outer.bitmap_gets += 1;
+    unsigned hashv;
+
+    HASH_VALUE(key, sizeof(bitmap_key_t), hashv);
+    policy_touch(&z->bitmap_policy, hashv);
+    HASH_FIND_BYHASHVALUE(hh, z->bitmap_cache, key, sizeof(bitmap_key_t), hashv, item);
+    if (item)
+        CACHE_REQUEUE(z, &z->bitmap_policy, z->bitmap_history, z->bitmap_protected, item, bitmap_sizeof,
+                                                                            z->outer.bitmap_limit);
+    return item;
+}
 
-    HASH_FIND(hh, z->bitmap_cache, &shape, sizeof(zhban_t *), item);
-    if (item) {
-        /* put the item at the head of history list */
-        DL_DELETE(z->bitmap_history, item);
-        DL_APPEND(z->bitmap_history, item);
+static void insert_bitmap(zhban_internal_t *z, bitmap_t *item) {
+    HASH_ADD_KEYPTR(hh, z->bitmap_cache, &item->key, sizeof(bitmap_key_t), item);
+    item->segment = CACHE_NEW;
+    CACHE_PUT(z, &z->bitmap_policy, z->bitmap_history, z->bitmap_protected, item, bitmap_sizeof, bitmap_hashv,
+                                                                        z->outer.bitmap_limit);
+    z->outer.bitmap_size += bitmap_sizeof(item);
+}
+
+/* returns an unrendered item for the key, its shape referenced */
+static bitmap_t *new_bitmap(zhban_internal_t *z, const bitmap_key_t *key) {
+    bitmap_t *item = get_idle_bitmap(z, key->shape, key->format);
+
+    item->key = *key;
+    item->source = NULL;
+    ZHBAN_INCREF(item->key.shape->refcount);
+    return item;
+}
+
+static zhban_bitmap_t *render_key(zhban_internal_t *z, bitmap_key_t *key, zhban_postproc_t pp, void *u) {
+    bitmap_t *item, *source = NULL;
+
+    z->outer.bitmap_gets += 1;
+    if ((item = find_bitmap(z, key))) {
         z->outer.bitmap_hits += 1;
         return (zhban_bitmap_t *)item;
     }
 
-    item = get_idle_bitmap(z, shape);
-    item->shape = shape;
-    ZHBAN_INCREF(item->shape->refcount);
+    if (pp || key->format != ZHBAN_FORMAT_RG16) {
+        /* variants share the raw render. the builtin color ones and other formats do without it
+           if it's not there, since they are rendered directly; others need it rendered anyway. */
+        bitmap_key_t raw_key;
+        make_key(&raw_key, key->shape, NULL, 0, ZHBAN_FORMAT_RG16);
+        source = find_bitmap(z, &raw_key);
+        if (!source && pp && pp != zhban_pp_color && pp != zhban_pp_color_vflip) {
+            source = new_bitmap(z, &raw_key);
+            render_shape(z, source, NULL, 0);
+            insert_bitmap(z, source);
+        }
+    }
 
-    render_shape(z, item);
+    if (source) {
+        source->pinned = 1;
+        item = new_bitmap(z, key);
+        derive_bitmap(z, item, source, pp, u);
+        source->pinned = 0;
+        z->outer.bitmap_derived += 1;
+    } else {
+        item = new_bitmap(z, key);
+        render_shape_pp(z, item, pp, u);
+    }
+    insert_bitmap(z, item);
 
-    HASH_ADD_KEYPTR(hh, z->bitmap_cache, &(item->shape), sizeof(zhban_t *), item);
-    DL_APPEND(z->bitmap_history, item);
-    z->outer.bitmap_size += bitmap_sizeof(item);
+    return (zhban_bitmap_t *)item;
+}
 
-    if (pp)
-        pp((zhban_bitmap_t *)item, zshape, u);
+zhban_bitmap_t *zhban_render_variant(zhban_t *zhban, zhban_shape_t *zshape, zhban_postproc_t pp, void *u, uint64_t tag) {
+    bitmap_key_t key;
 
-    return (zhban_bitmap_t *)item;
+    make_key(&key, (shape_t *)zshape, pp, tag, ZHBAN_FORMAT_RG16);
+    return render_key((zhban_internal_t *)zhban, &key, pp, u);
+}
+
+zhban_bitmap_t *zhban_render_format(zhban_t *zhban, zhban_shape_t *zshape, uint32_t format, uint32_t color) {
+    zhban_internal_t *z = (zhban_internal_t *)zhban;
+    bitmap_key_t key;
+
+    if (format > ZHBAN_FORMAT_BGRA8) {
+        log_error(z, "unknown bitmap format %d", format);
+        return NULL;
+    }
+    make_key(&key, (shape_t *)zshape, NULL, color & 0x00FFFFFFu, format);
+    return render_key(z, &key, NULL, NULL);
+}
+
+zhban_bitmap_t *zhban_render_pp(zhban_t *zhban, zhban_shape_t *zshape, zhban_postproc_t pp, void *u) {
+    return zhban_render_variant(zhban, zshape, pp, u, default_tag(pp, u));
 }
 
 zhban_bitmap_t *zhban_render(zhban_t *zhban, zhban_shape_t *zshape) {
     return zhban_render_pp(zhban, zshape, NULL, NULL);
 }
 
+/* composites a clipped run of zhban_render_into(): constant coverage if src is NULL, else a row of it */
+static inline void put_into(zhban_internal_t *z, uint8_t *row, const zhban_rect_t *clip, int32_t x, uint32_t len,
+                    const uint8_t *src, uint16_t coverage, uint32_t format, uint32_t color, uint32_t cluster) {
+    int32_t left = x < clip->x ? clip->x : x;
+    int32_t right = x + (int32_t)len < clip->x + clip->w ? x + (int32_t)len : clip->x + clip->w;
+
+    if (right <= left)
+        return;
+    len = right - left;
+    if (src)
+        src += left - x;
+    switch (format) {
+        case ZHBAN_FORMAT_R8:
+            if (src)
+                z->blit->tile_row8(row + left, src, len);
+            else
+                z->blit->span8(row + left, len, coverage & 0xFF);
+            break;
+        case ZHBAN_FORMAT_RG16:
+            if (src)
+                z->blit->tile_row((uint32_t *)row + left, src, len, 0x0000FFFFu, cluster << 16, 0);
+            else
+                z->blit->span((uint32_t *)row + left, len, 0x0000FFFFu, cluster << 16 | coverage);
+            break;
+        default:
+            if (src)
+                z->blit->over_row((uint32_t *)row + left, src, len, color);
+            else
+                z->blit->over_span((uint32_t *)row + left, len, coverage & 0xFF, color);
+            break;
+    }
+}
+
+int zhban_render_into(zhban_t *zhban, zhban_shape_t *zshape, void *dst, int32_t stride, uint32_t format,
+                                                uint32_t color, int32_t x, int32_t y, const zhban_rect_t *clip) {
+    zhban_internal_t *z = (zhban_internal_t *)zhban;
+    shape_t *sh = (shape_t *)zshape;
+    const uint32_t glyph_count = sh->glyphs_used/sizeof(glyph_info_t);
+
+    if (format > ZHBAN_FORMAT_BGRA8 || format == ZHBAN_FORMAT_R8_CLUSTERS) {
+        log_error(z, "cannot render into format %d", format);
+        return 1;
+    }
+    color = format_color(format, color);
+
+    for (uint32_t glyph_i = 0; glyph_i < glyph_count; glyph_i++) {
+        glyph_info_t *g_info = sh->glyphs + glyph_i;
+        glyph_t *glyph = g_info->glyph;
+        const uint32_t cluster = g_info->cluster & 0xFFFFu;
+        const int32_t gx = x + (g_info->x_origin >> 6);
+        const int32_t gy = y + (g_info->y_origin >> 6);
+
+        /* blank or entirely clipped off */
+        if (glyph->min_span_x == INT_MAX
+                || gx + glyph->max_span_x <= clip->x || gx + glyph->min_span_x >= clip->x + clip->w
+                || gy + glyph->max_y < clip->y || gy + glyph->min_y >= clip->y + clip->h)
+            continue;
+
+        if (glyph->tiled) {
+            const uint32_t tile_w = glyph_tile_w(glyph), tile_h = glyph_tile_h(glyph);
+            const uint8_t *src = glyph_tile(glyph);
+
+            for (uint32_t row = 0; row < tile_h; row++, src += tile_w) {
+                const int32_t py = gy + glyph->min_y + (int32_t)row;
+                if (py >= clip->y && py < clip->y + clip->h)
+                    put_into(z, (uint8_t *)dst + (ptrdiff_t)py * stride, clip, gx + glyph->min_span_x, tile_w,
+                                                                            src, 0, format, color, cluster);
+            }
+        }
+
+        const uint32_t span_count = glyph_span_count(glyph);
+        for (uint32_t span_i = 0; span_i < span_count; span_i++) {
+            span_t *span = glyph_spans(glyph) + span_i;
+            const int32_t py = gy + span->y;
+            if (py >= clip->y && py < clip->y + clip->h)
+                put_into(z, (uint8_t *)dst + (ptrdiff_t)py * stride, clip, gx + span->x, span->len,
+                                                                    NULL, span->coverage, format, color, cluster);
+        }
+    }
+    return 0;
+}
+
+void zhban_set_render_threads(zhban_t *zhban, uint32_t nthreads) {
+    zhban_internal_t *z = (zhban_internal_t *)zhban;
+
+    pool_destroy(z->render_pool);
+    z->render_pool = NULL;
+    z->render_threads = nthreads;
+}
+
+typedef struct _batch_job {
+    zhban_internal_t *z;
+    bitmap_t **items;
+    zhban_postproc_t pp;
+    void *u;
+} batch_job_t;
+
+static void render_batch_item(void *ctx, uint32_t index, uint32_t worker ATTR_UNUSED) {
+    batch_job_t *job = (batch_job_t *)ctx;
+    bitmap_t *item = job->items[index];
+
+    if (item->source)
+        derive_bitmap(job->z, item, item->source, job->pp, job->u);
+    else
+        render_shape_pp(job->z, item, job->pp, job->u);
+}
+
+void zhban_render_batch(zhban_t *zhban, zhban_shape_t **zshapes, zhban_bitmap_t **bitmaps, uint32_t count,
+                                                            zhban_postproc_t pp, void *u) {
+    zhban_internal_t *z = (zhban_internal_t *)zhban;
+    uint32_t misses = 0;
+
+    if (!z->render_pool)
+        z->render_pool = pool_create(z->render_threads);
+
+    if (z->batch_allocd < count) {
+        bitmap_t **items = realloc(z->batch_items, sizeof(bitmap_t *) * count);
+        if (!items) {
+            log_error(z, "realloc(%d items) failed", count);
+            memset(bitmaps, 0, sizeof(zhban_bitmap_t *) * count);
+            return;
+        }
+        z->batch_items = items;
+        z->batch_allocd = count;
+    }
+
+    /* lookups, evictions and cache insertions are done here, in the calling thread.
+       misses are inserted right away, unrendered, so that duplicates within the batch
+       hit them. everything handed out is pinned until the batch is done. */
+    const uint64_t tag = default_tag(pp, u);
+    for (uint32_t i = 0; i < count; i++) {
+        bitmap_key_t key;
+        bitmap_t *item;
+
+        z->outer.bitmap_gets += 1;
+        make_key(&key, (shape_t *)zshapes[i], pp, tag, ZHBAN_FORMAT_RG16);
+        if ((item = find_bitmap(z, &key))) {
+            z->outer.bitmap_hits += 1;
+        } else {
+            bitmap_t *source = NULL;
+            if (pp) {
+                /* derive from the raw render if it's there, and not part of this batch,
+                   where it might be still unrendered */
+                bitmap_key_t raw_key;
+                make_key(&raw_key, key.shape, NULL, 0, ZHBAN_FORMAT_RG16);
+                source = find_bitmap(z, &raw_key);
+                if (source && source->pinned)
+                    source = NULL;
+                if (source) {
+                    source->pinned = 1;
+                    z->outer.bitmap_derived += 1;
+                }
+            }
+            item = new_bitmap(z, &key);
+            item->source = source;
+            insert_bitmap(z, item);
+            z->batch_items[misses++] = item;
+        }
+        item->pinned = 1;
+        bitmaps[i] = (zhban_bitmap_t *)item;
+    }
+
+    log_trace(z, "%d shapes, %d misses, %d workers", count, misses,
+                    z->render_pool ? pool_size(z->render_pool) : 0);
+
+    batch_job_t job = { z, z->batch_items, pp, u };
+    if (z->render_pool)
+        pool_run(z->render_pool, render_batch_item, &job, misses);
+    else
+        for (uint32_t i = 0; i < misses; i++)
+            render_batch_item(&job, i, 0);
+
+    for (uint32_t i = 0; i < misses; i++) {
+        if (z->batch_items[i]->source) {
+            z->batch_items[i]->source->pinned = 0;
+            z->batch_items[i]->source = NULL;
+        }
+    }
+    for (uint32_t i = 0; i < count; i++)
+        ((bitmap_t *)bitmaps[i])->pinned = 0;
+}
+
+/* zhban_render_pp() does not call these two, it renders RGBA right away. see render_shape_pp() */
 void zhban_pp_color(zhban_bitmap_t *b, zhban_shape_t *s ATTR_UNUSED, void *u) {
     /* FIXME: endianness */
     uint32_t color = (*(uint32_t *)u) & 0x00FFFFFFu;
-    for(uint32_t i = 0; i < b->data_size/4; i++) {
-        uint32_t alpha = (b->data[i] & 0xFFu) << 24;
-        if (alpha)
-            b->data[i] = color | alpha;
-        else
-            b->data[i] = 0;
+    blit_kernels()->colorize(b->data, b->data_size/4, color);
+}
+
+void zhban_pp_color_vflip(zhban_bitmap_t *b, zhban_shape_t *s, void *u) {
+    uint32_t chunk[256];
+
+    zhban_pp_color(b, s, u);
+
+    /* swap rows in place, a chunk at a time */
+    for (int32_t y = 0; y < s->h / 2; y++) {
+        uint32_t *top = b->data + s->w * (s->h - y - 1);
+        uint32_t *bottom = b->data + s->w * y;
+        for (int32_t x = 0; x < s->w; x += 256) {
+            uint32_t n = s->w - x < 256 ? s->w - x : 256;
+            memcpy(chunk, top + x, n * 4);
+            memcpy(top + x, bottom + x, n * 4);
+            memcpy(bottom + x, chunk, n * 4);
+        }
     }
 }
+//}
+//{ atlas
+/*  Shelf packer: each page is cut into horizontal shelves bottom to top,
+    glyphs are put left to right onto the shelf of the closest height that has room.
+    Nothing is ever freed; when no page can take a glyph and no more pages are allowed,
+    the whole atlas is wiped and a new generation started. */
+
+#define ATLAS_PADDING 1     /* between glyphs, so that linear filtering does not bleed */
+
+typedef struct _atlas_shelf {
+    uint32_t y, h;          /* bottom row and height */
+    uint32_t x;             /* first free column */
+} atlas_shelf_t;
+
+struct _atlas_page {
+    zhban_atlas_page_t page;
+    atlas_shelf_t *shelves;
+    uint32_t shelf_count;
+    uint32_t shelf_allocd;  /* in shelves */
+    uint32_t top;           /* first row above all shelves */
+};
 
-void zhban_pp_color_vflip(zhban_bitmap_t *b, zhban_shape_t *s ATTR_UNUSED, void *u) {
-    /* FIXME: endianness */
-    uint32_t color = (*(uint32_t *)u) & 0x00FFFFFFu;
-    bitmap_t *bitmap = (bitmap_t *)b;
-    uint32_t *buf = malloc(bitmap->data_allocd);
-    for (int32_t y = 0; y < s->h ; y++) {
-        for (int32_t x = 0; x < s->w ; x++) {
-            uint32_t i =  x + s->w * y;
-            uint32_t j =  x + s->w * (s->h - y - 1);
-            uint32_t alpha = (b->data[i] & 0xFFu) << 24;
-            if (alpha)
-                buf[j] = color | alpha;
-            else
-                buf[j] = 0;
+static void drop_atlas(zhban_internal_t *z) {
+    for (uint32_t i = 0; i < z->atlas_page_count; i++) {
+        free(z->atlas_pages[i].page.data);
+        free(z->atlas_pages[i].shelves);
+    }
+    free(z->atlas_pages);
+    free(z->atlas_quads.quads);
+    z->atlas_pages = NULL;
+    z->atlas_page_count = 0;
+    z->atlas_quads.quads = NULL;
+    z->atlas_quads_allocd = 0;
+    z->outer.atlas_size = 0;
+}
+
+static void wipe_atlas(zhban_internal_t *z) {
+    for (uint32_t i = 0; i < z->atlas_page_count; i++) {
+        atlas_page_t *p = z->atlas_pages + i;
+        memset(p->page.data, 0, p->page.w * p->page.h);
+        p->shelf_count = 0;
+        p->top = 0;
+        p->page.serial += 1;
+    }
+    z->atlas_generation += 1;
+    z->outer.atlas_resets += 1;
+    log_trace(z, "atlas wiped, generation %d", z->atlas_generation);
+}
+
+static atlas_page_t *add_atlas_page(zhban_internal_t *z) {
+    atlas_page_t *pages = realloc(z->atlas_pages, sizeof(atlas_page_t) * (z->atlas_page_count + 1));
+    if (!pages)
+        return NULL;
+    z->atlas_pages = pages;
+
+    atlas_page_t *p = pages + z->atlas_page_count;
+    memset(p, 0, sizeof(atlas_page_t));
+    p->page.w = z->atlas_w;
+    p->page.h = z->atlas_h;
+    p->page.data = malloc(z->atlas_w * z->atlas_h);
+    if (!p->page.data)
+        return NULL;
+    memset(p->page.data, 0, z->atlas_w * z->atlas_h);
+
+    z->atlas_page_count += 1;
+    z->outer.atlas_size += z->atlas_w * z->atlas_h;
+    return p;
+}
+
+/* returns nonzero if there's no room for a w x h rectangle on the page */
+static int shelf_alloc(atlas_page_t *p, uint32_t w, uint32_t h, uint32_t *x, uint32_t *y) {
+    atlas_shelf_t *best = NULL;
+
+    for (uint32_t i = 0; i < p->shelf_count; i++) {
+        atlas_shelf_t *shelf = p->shelves + i;
+        if (shelf->h < h || shelf->x + w > p->page.w)
+            continue;
+        /* don't waste tall shelves on much smaller glyphs */
+        if (shelf->h > h + h/2 + 2)
+            continue;
+        if (!best || shelf->h < best->h)
+            best = shelf;
+    }
+
+    if (!best) {
+        if (p->top + h > p->page.h || w > p->page.w)
+            return 1;
+        if (p->shelf_count == p->shelf_allocd) {
+            uint32_t allocd = p->shelf_allocd ? 2 * p->shelf_allocd : 16;
+            atlas_shelf_t *shelves = realloc(p->shelves, sizeof(atlas_shelf_t) * allocd);
+            if (!shelves)
+                return 1;
+            p->shelves = shelves;
+            p->shelf_allocd = allocd;
         }
+        best = p->shelves + p->shelf_count++;
+        best->y = p->top;
+        best->h = h;
+        best->x = 0;
+        p->top += h;
+    }
+
+    *x = best->x;
+    *y = best->y;
+    best->x += w;
+    return 0;
+}
+
+/* returns nonzero if the atlas is full */
+static int atlas_place_glyph(zhban_internal_t *z, glyph_t *glyph) {
+    uint32_t w, h, x = 0, y = 0, pi;
+
+    if (glyph->atlas_generation == z->atlas_generation)
+        return 0;
+
+    if (glyph->min_span_x == INT_MAX) {
+        /* empty glyph, like space. nothing to place. */
+        glyph->atlas_generation = z->atlas_generation;
+        return 0;
+    }
+
+    w = glyph->max_span_x - glyph->min_span_x;
+    h = glyph->max_y - glyph->min_y + 1;
+
+    for (pi = 0; pi < z->atlas_page_count; pi++)
+        if (!shelf_alloc(z->atlas_pages + pi, w + ATLAS_PADDING, h + ATLAS_PADDING, &x, &y))
+            break;
+
+    if (pi == z->atlas_page_count) {
+        if (z->atlas_page_count == z->atlas_max_pages)
+            return 1;
+        atlas_page_t *p = add_atlas_page(z);
+        if (!p || shelf_alloc(p, w + ATLAS_PADDING, h + ATLAS_PADDING, &x, &y))
+            return 1;
+    }
+
+    atlas_page_t *p = z->atlas_pages + pi;
+    if (glyph->tiled)
+        for (uint32_t row = 0; row < h; row++)
+            memcpy(p->page.data + (y + row) * p->page.w + x, glyph_tile(glyph) + row * w, w);
+    for (uint32_t i = 0; i < glyph_span_count(glyph); i++) {
+        span_t *span = glyph_spans(glyph) + i;
+        if (span->y < glyph->min_y || span->y > glyph->max_y
+                || span->x < glyph->min_span_x || span->x + span->len > glyph->max_span_x) {
+            log_error(z, "glyph %x: span %d out of its box, skipped", glyph->codepoint, i);
+            continue;
+        }
+        uint8_t *row = p->page.data + (y + span->y - glyph->min_y) * p->page.w + x - glyph->min_span_x;
+        memset(row + span->x, span->coverage & 0xFF, span->len);
+    }
+    p->page.serial += 1;
+
+    glyph->atlas_generation = z->atlas_generation;
+    glyph->atlas_page = pi;
+    glyph->atlas_x = x;
+    glyph->atlas_y = y;
+    return 0;
+}
+
+int zhban_atlas_setup(zhban_t *zhban, uint32_t page_w, uint32_t page_h, uint32_t max_pages) {
+    zhban_internal_t *z = (zhban_internal_t *)zhban;
+
+    drop_atlas(z);
+    if (!page_w || !page_h || !max_pages) {
+        log_error(z, "bogus atlas geometry %dx%d, %d pages", page_w, page_h, max_pages);
+        return 1;
     }
-    free(b->data);
-    b->data = buf;
+    z->atlas_w = page_w;
+    z->atlas_h = page_h;
+    z->atlas_max_pages = max_pages;
+    z->atlas_generation += 1;   /* whatever glyphs have from before is not valid anymore */
+    return 0;
+}
+
+zhban_atlas_page_t *zhban_atlas_page(zhban_t *zhban, uint32_t index) {
+    zhban_internal_t *z = (zhban_internal_t *)zhban;
+
+    if (index >= z->atlas_page_count)
+        return NULL;
+    return &z->atlas_pages[index].page;
 }
+
+zhban_quads_t *zhban_render_quads(zhban_t *zhban, zhban_shape_t *zshape) {
+    zhban_internal_t *z = (zhban_internal_t *)zhban;
+    shape_t *sh = (shape_t *)zshape;
+    const uint32_t glyph_count = sh->glyphs_used/sizeof(glyph_info_t);
+    uint32_t i;
+
+    if (!z->atlas_max_pages) {
+        log_error(z, "atlas is not set up");
+        return NULL;
+    }
+
+    if (z->atlas_quads_allocd < glyph_count) {
+        zhban_quad_t *quads = realloc(z->atlas_quads.quads, sizeof(zhban_quad_t) * glyph_count);
+        if (!quads)
+            return NULL;
+        z->atlas_quads.quads = quads;
+        z->atlas_quads_allocd = glyph_count;
+    }
+
+    for (i = 0; i < glyph_count; i++)
+        if (atlas_place_glyph(z, sh->glyphs[i].glyph))
+            break;
+
+    if (i < glyph_count) {
+        /* out of room. start over with an empty atlas */
+        wipe_atlas(z);
+        for (i = 0; i < glyph_count; i++)
+            if (atlas_place_glyph(z, sh->glyphs[i].glyph)) {
+                log_error(z, "shape %p does not fit into the atlas at all", sh);
+                return NULL;
+            }
+    }
+
+    z->atlas_quads.count = 0;
+    z->atlas_quads.generation = z->atlas_generation;
+    for (i = 0; i < glyph_count; i++) {
+        glyph_info_t *g_info = sh->glyphs + i;
+        glyph_t *glyph = g_info->glyph;
+        if (glyph->min_span_x == INT_MAX)
+            continue;
+
+        zhban_quad_t *q = z->atlas_quads.quads + z->atlas_quads.count++;
+        q->page = glyph->atlas_page;
+        q->x = glyph->atlas_x;
+        q->y = glyph->atlas_y;
+        q->w = glyph->max_span_x - glyph->min_span_x;
+        q->h = glyph->max_y - glyph->min_y + 1;
+        q->dst_x = (g_info->x_origin >> 6) + glyph->min_span_x;
+        q->dst_y = (g_info->y_origin >> 6) + glyph->min_y;
+        q->cluster = g_info->cluster;
+    }
+    return &z->atlas_quads;
+}
+
 #if defined(USE_SDL2)
 SDL_Surface *zhban_sdl_render_rgba(zhban_t *zhban, zhban_shape_t *shape, SDL_Color fg) {
     return NULL;
@@ -72,7 +72,10 @@ extern_C_curly_opens
 
     zhban_t data members are strictly read-only.
 
-    Caches and all FreeType data is kept in two sets, each used only by one of the functions.
+    zhban_shape() can be called from any number of threads at once: each call borrows
+    a FreeType face and HarfBuzz font+buffer set from a pool, creating one if none is idle.
+    Shape cache is locked, glyph cache is split into separately locked shards,
+    refcounts are C11 atomics. Bitmap cache is used only by the render thread.
 */
 
 typedef struct _zhban {
@@ -87,20 +90,105 @@ typedef struct _zhban {
     uint32_t shaper_size, shaper_limit, shaper_gets, shaper_hits, shaper_evictions;
     uint32_t bitmap_size, bitmap_limit, bitmap_gets, bitmap_hits, bitmap_evictions;
 
+    /* atlas statistics */
+    uint32_t atlas_size, atlas_resets;
+
+    /* word cache statistics, see zhban_set_word_cache() */
+    uint32_t word_gets, word_hits;
+
+    /* bitmap variants made out of a cached raw render instead of rendering */
+    uint32_t bitmap_derived;
+
+    /* replacement policy in force, see zhban_set_cache_policy(). items promoted
+       to the protected list, and new items put first in line for eviction by TinyLFU */
+    uint32_t cache_policy, cache_promotions, cache_rejections;
+
+    /* glyphs taken from a zhban_load_glyph_cache() file instead of being rasterized */
+    uint32_t glyph_loaded;
+
+    /* glyphs taken from the zhban_share_glyphs() store, rasterized by another process or zhban_t */
+    uint32_t glyph_shared;
+
+    /* codepoints and strings given to zhban_prewarm_*(), and how many of them are done.
+       updated from the warmer thread: read them with zhban_prewarm_pending() */
+    uint32_t prewarm_queued, prewarm_done;
+
+    /* lines cut out of zhban_shape_paragraph() results, and those shaped anew
+       as their ends fell where HarfBuzz says it's unsafe to break */
+    uint32_t paragraph_lines, paragraph_reshaped;
+
+    /* font fact: pixels from the baseline down to the bottom of a line_step high line, see zhban_screen_open() */
+    uint32_t descent;
+
+    /* strings zhban_shape_batch() found earlier in the same batch, left out of shaper_gets and shaper_hits */
+    uint32_t batch_duplicates;
+
 } zhban_t;
 
+/* font data, shareable by zhban_t of different sizes, see zhban_font_open() */
+typedef struct _zhban_font {
+    /* outline cache statistics */
+    uint32_t outline_size, outline_limit, outline_gets, outline_hits;
+} zhban_font_t;
+
+/* a paragraph shaped to cut lines out of, see zhban_shape_paragraph() */
+typedef struct _zhban_paragraph zhban_paragraph_t;
+
+/* interned string, see zhban_intern() */
+typedef struct _zhban_handle {
+    const uint16_t *string;     /* a copy, owned by the zhban_t */
+    uint32_t size;              /* in bytes */
+    uint64_t hash;              /* precomputed key hash */
+} zhban_handle_t;
+
 typedef struct _zhban_shape {
     int32_t w, h;               /* bounding box = bitmap size */
     int32_t origin_x, origin_y; /* first glyph origin coords relative to bottom left corner. GL/FT2 coordinate system */
 } zhban_shape_t;
 
+/* bitmap pixel formats, see zhban_render_format() */
+#define ZHBAN_FORMAT_RG16           0   /* RG_16UI of (intensity, index_in_source_string), the default */
+#define ZHBAN_FORMAT_R8             1   /* 8-bit intensity */
+#define ZHBAN_FORMAT_R8_CLUSTERS    2   /* 8-bit intensity, and index_in_source_string in a separate 16-bit plane */
+#define ZHBAN_FORMAT_RGBA8          3   /* premultiplied single color, R first in memory */
+#define ZHBAN_FORMAT_BGRA8          4   /* premultiplied single color, B first in memory */
+
 typedef struct _zhban_bitmap {
-    uint32_t *data;             /* RG_16UI of (intensity, index_in_source_string), or NULL. w*h*4 bytes. */
+    uint32_t *data;             /* pixels in the format below, bottom row first, rows not padded. or NULL. */
     uint32_t data_size;         /* size of the above buffer in bytes */
     uint32_t *cluster_map;      /* a row of cluster indices for background. go from glyph origin to next glyph origin. */
     uint32_t cluster_map_size;  /* size of the above buffer in bytes */
+    uint32_t format;            /* ZHBAN_FORMAT_* */
+    uint16_t *cluster_plane;    /* ZHBAN_FORMAT_R8_CLUSTERS: w*h indices in source string where intensity is nonzero */
+    uint32_t cluster_plane_size;/* size of the above buffer in bytes */
 } zhban_bitmap_t;
 
+/* atlas page: R8 coverage, w*h bytes, bottom row first, same as the bitmaps. */
+typedef struct _zhban_atlas_page {
+    uint8_t *data;
+    uint32_t w, h;
+    uint32_t serial;            /* changes whenever page contents do. compare to know when to re-upload */
+} zhban_atlas_page_t;
+
+/* a glyph to draw: rectangle in an atlas page and where to put it */
+typedef struct _zhban_quad {
+    uint32_t page;              /* index for zhban_atlas_page() */
+    int32_t x, y, w, h;         /* rectangle in the page */
+    int32_t dst_x, dst_y;       /* where its bottom left corner goes, relative to that of the shape bounding box */
+    uint32_t cluster;           /* index in source string, same as in the bitmap G channel */
+} zhban_quad_t;
+
+typedef struct _zhban_quads {
+    zhban_quad_t *quads;
+    uint32_t count;
+    uint32_t generation;        /* of the atlas. when it changes, quads from earlier calls are no longer valid */
+} zhban_quads_t;
+
+/* a rectangle in a framebuffer, x, y being its bottom left corner */
+typedef struct _zhban_rect {
+    int32_t x, y, w, h;
+} zhban_rect_t;
+
 #define ZHLOG_TRACE 5
 #define ZHLOG_INFO  4
 #define ZHOGL_WARN  3
@@ -124,13 +212,96 @@ ZHB_EXPORT zhban_t *zhban_open(const void *data, const uint32_t size,
                                 int llevel, zhban_logsink_t lsink);
 ZHB_EXPORT void zhban_drop(zhban_t *);
 
-/* HarfBuzz specifics for non-latin/cyrillic scripts:
+/* font data to open any number of zhban_t with, for example one per pixel height. with subpixel
+   positioning, glyphs are rendered unhinted out of outlines the font keeps, in font units, so that
+   each is loaded once for all the sizes and subpixel offsets it is rendered at.
+    data, size - same as for zhban_open()
+    outlinelimit - outline cache limit in bytes. past it, outlines are loaded for each render.
+   NULL on error.
+*/
+ZHB_EXPORT zhban_font_t *zhban_font_open(const void *data, const uint32_t size, uint32_t outlinelimit);
+
+/* outline limit of fonts that zhban_open() and zhban_add_face() make for themselves, see zhban_set_outline_limit() */
+#define ZHBAN_OUTLINE_LIMIT (256 << 10)
+
+/* same as zhban_open(), with the font's data. zhban_open() makes a font of its own, with ZHBAN_OUTLINE_LIMIT */
+ZHB_EXPORT zhban_t *zhban_open_font(zhban_font_t *font,
+                                uint32_t pixheight,
+                                uint32_t subpixel_positioning,
+                                uint32_t glyphlimit, uint32_t sizerlimit, uint32_t renderlimit,
+                                int llevel, zhban_logsink_t lsink);
+
+/* releases the font. it stays around until all zhban_t opened with it are dropped too. */
+ZHB_EXPORT void zhban_font_drop(zhban_font_t *font);
+
+/* adds a fallback face, used for characters that the ones added earlier don't have, up to 7 of them.
+   the zhban_t's caches and their limits are shared by all faces; the fallback is sized to the same
+   pixels per em as the first face. data must stay around same as for zhban_open().
+   not to be called while anything is being shaped, nor after zhban_load_glyph_cache() or zhban_share_glyphs().
+   cached shapes are dropped, shapes still referenced stay valid. return value: nonzero on error.
+*/
+ZHB_EXPORT int zhban_add_face(zhban_t *zhban, const void *data, const uint32_t size);
+
+/* same, with the font's data and outline cache */
+ZHB_EXPORT int zhban_add_font(zhban_t *zhban, zhban_font_t *font);
+
+/* HarfBuzz specifics for non-latin/cyrillic scripts. not to be called while anything is being shaped.
     direction:  ltr, rtl, ttb, btt
     script:     see Harfbuzz src/hb-common.h Latn, Cyrl, etc.
     language:   "en" - english, "ar"- arabic, "ch" - chinese. looks like some ISO code
 */
 ZHB_EXPORT void zhban_set_script(zhban_t *zhban, const char *direction, const char *script, const char *language);
 
+/* if nonzero, strings missing from the shape cache are split after spaces, words are shaped
+   and cached separately, and the string is composed out of them. words that HarfBuzz flags
+   unsafe to break between are shaped together. only for left-to-right text, others are shaped whole.
+   not to be called while anything is being shaped.
+*/
+ZHB_EXPORT void zhban_set_word_cache(zhban_t *zhban, uint32_t enable);
+
+/* with subpixel positioning, snaps glyph positions to x_phases by y_phases evenly spaced offsets
+   within a pixel, 1 to 64 each, instead of 1/64th of a pixel, capping the number of variants
+   rasterized and cached per glyph. for example 4, 1 gets most of the look at a fraction of the memory.
+   default is 64, 64. to be called before anything is shaped, and before zhban_load_glyph_cache()
+   or zhban_share_glyphs(): once glyphs are cached, a change is refused.
+   return value: nonzero on error.
+*/
+ZHB_EXPORT int zhban_set_subpixel_phases(zhban_t *zhban, uint32_t x_phases, uint32_t y_phases);
+
+/* sets the outline cache limit, in bytes, of the fonts of all the faces, shared ones included.
+   0 turns the cache off. outlines already kept stay until the font is dropped.
+*/
+ZHB_EXPORT void zhban_set_outline_limit(zhban_t *zhban, uint32_t limit);
+
+/* writes the glyph cache to a file, for zhban_load_glyph_cache() to pick up on the next start.
+   the file is replaced atomically. shaping waits while it is written. return value: nonzero on error.
+*/
+ZHB_EXPORT int zhban_save_glyph_cache(zhban_t *zhban, const char *path);
+
+/* maps a file written by zhban_save_glyph_cache(), taking glyphs out of it instead of rasterizing.
+   ignored if it was made for other font data or size, or by another version of the library. call once, before anything is shaped. return value: nonzero if not loaded.
+*/
+ZHB_EXPORT int zhban_load_glyph_cache(zhban_t *zhban, const char *path);
+
+/* keeps rendered glyphs in a named POSIX shared memory segment of the given size, creating it if
+   there's none, so that processes using the same font at the same size rasterize each glyph once.
+   glyphs that don't fit once it's full stay private. the segment outlives the processes, remove it
+   with shm_unlink() when the font or size changes. call once, before anything is shaped.
+   return value: nonzero on error, or if the segment is in use for other font data or size.
+*/
+ZHB_EXPORT int zhban_share_glyphs(zhban_t *zhban, const char *name, uint32_t size);
+
+/* cache replacement policies, see zhban_set_cache_policy() */
+#define ZHBAN_CACHE_LRU         0   /* least recently used goes first, the default */
+#define ZHBAN_CACHE_SLRU        1   /* items hit more than once are evicted after those that were not */
+#define ZHBAN_CACHE_TINYLFU     2   /* SLRU, plus new items asked for no more often than the next victim go first */
+
+/* sets replacement policy of the glyph, shape and bitmap caches, and resets their
+   gets, hits and evictions, so that these are per policy. not to be called while rendering;
+   threads shaping meanwhile are fine, the counts are reset atomically.
+*/
+ZHB_EXPORT void zhban_set_cache_policy(zhban_t *zhban, uint32_t policy);
+
 /* returns expected size of bitmap for the string in rv. data pointer is NULL.
    params:
     in
@@ -142,6 +313,130 @@ ZHB_EXPORT void zhban_set_script(zhban_t *zhban, const char *direction, const ch
 */
 ZHB_EXPORT zhban_shape_t *zhban_shape(zhban_t *zhban, const uint16_t *string, const uint32_t strsize);
 
+/* shapes a number of strings at once. duplicates are shaped once, each returned shape holds its own reference.
+   params:
+    in
+        zhban - which zhban to shape with
+        strings - UCS-2 string buffers
+        strsizes - their sizes in bytes
+        count - number of strings
+    out
+        shapes - count of zhban_shape_t*, NULL on error
+*/
+ZHB_EXPORT void zhban_shape_batch(zhban_t *zhban, const uint16_t **strings, const uint32_t *strsizes, uint32_t count,
+                                                                                        zhban_shape_t **shapes);
+
+/* returns a handle for the string, same for the same string until all its handles are released.
+   for strings that are shaped over and over, like those in a UI: the string is hashed once here,
+   instead of on every zhban_shape() call. can be called from any thread. NULL on error.
+*/
+ZHB_EXPORT zhban_handle_t *zhban_intern(zhban_t *zhban, const uint16_t *string, const uint32_t strsize);
+
+/* same as zhban_shape(), but for an interned string */
+ZHB_EXPORT zhban_shape_t *zhban_shape_handle(zhban_t *zhban, const zhban_handle_t *handle);
+
+/* releases a handle from zhban_intern(). shapes got with it stay valid */
+ZHB_EXPORT void zhban_release_handle(zhban_t *zhban, zhban_handle_t *handle);
+
+/* rasterizes glyphs for codepoint ranges ahead of time, so that first use does not have to.
+    ranges - count pairs of first and last codepoint, inclusive
+    background - if nonzero, the work is queued for a thread of its own, running at idle priority,
+                 and the call returns right away. otherwise it's done in the calling thread.
+   with subpixel positioning, only glyphs at whole pixels are done unless there are few phases,
+   see zhban_set_subpixel_phases(). see zhban_prewarm_pending() and zhban_prewarm_wait() for progress.
+   return value: nonzero on error.
+*/
+ZHB_EXPORT int zhban_prewarm_codepoints(zhban_t *zhban, const uint32_t *ranges, uint32_t count, uint32_t background);
+
+/* same for strings: shapes them, and so rasterizes their glyphs, leaving them in the caches.
+   strings are copied if done in the background. */
+ZHB_EXPORT int zhban_prewarm_strings(zhban_t *zhban, const uint16_t **strings, const uint32_t *strsizes, uint32_t count,
+                                                                                            uint32_t background);
+
+/* codepoints and strings given to zhban_prewarm_*() and not done yet, read atomically.
+   zero when prewarming is over. */
+ZHB_EXPORT uint32_t zhban_prewarm_pending(zhban_t *zhban);
+
+/* blocks until the background prewarm queue is done with */
+ZHB_EXPORT void zhban_prewarm_wait(zhban_t *zhban);
+
+/* shapes a whole paragraph, for zhban_paragraph_line() to cut lines out of without shaping them again,
+   so that reflowing it costs about as much as there are lines. the string is copied. NULL on error.
+   right-to-left and bottom-to-top paragraphs are kept, but each line is shaped by itself. */
+ZHB_EXPORT zhban_paragraph_t *zhban_shape_paragraph(zhban_t *zhban, const uint16_t *string, const uint32_t strsize);
+
+/* same as zhban_shape() of the paragraph's characters start to end - 1, in UTF-16 units, and cached the same way.
+   glyphs are copied out of the paragraph if HarfBuzz says it's safe to break at start and end, otherwise
+   the line is shaped by itself. release the shape with zhban_release_shape(). NULL on error. */
+ZHB_EXPORT zhban_shape_t *zhban_paragraph_line(zhban_t *zhban, zhban_paragraph_t *paragraph, uint32_t start, uint32_t end);
+
+/* releases the paragraph. lines cut out of it stay valid */
+ZHB_EXPORT void zhban_release_paragraph(zhban_t *zhban, zhban_paragraph_t *paragraph);
+
+/* paragraph layout modes, see zhban_layout_paragraph() */
+#define ZHBAN_LAYOUT_GREEDY     0   /* as many words on a line as fit */
+#define ZHBAN_LAYOUT_BALANCED   1   /* minimum raggedness: least sum of squares of space left at line ends */
+
+typedef struct _zhban_word {
+    zhban_shape_t *shape;       /* held by the layout */
+    uint32_t start, length;     /* in the source string, in UTF-16 units */
+    int32_t x, y;               /* bottom left corner of the shape bounding box, relative to that of the layout */
+} zhban_word_t;
+
+typedef struct _zhban_line {
+    uint32_t first_word, word_count;
+    int32_t width;              /* from the left edge, indent included, to the end of the last word */
+    int32_t baseline;           /* relative to the bottom of the layout */
+} zhban_line_t;
+
+typedef struct _zhban_layout {
+    zhban_word_t *words;
+    uint32_t word_count;
+    zhban_line_t *lines;        /* first at the top */
+    uint32_t line_count;
+    int32_t w, h;               /* bounding box: width given, or more if a word doesn't fit */
+} zhban_layout_t;
+
+/* breaks a paragraph into lines. words are split at whitespace and shaped with zhban_shape(),
+   so that they come from the shape cache on reflow, and are set left to right, space_advance apart,
+   with baselines line_step apart.
+    width - line width in pixels
+    indent - first line indent in pixels
+    mode - ZHBAN_LAYOUT_*
+   return value: NULL on error. */
+ZHB_EXPORT zhban_layout_t *zhban_layout_paragraph(zhban_t *zhban, const uint16_t *string, const uint32_t strsize,
+                                                            int32_t width, int32_t indent, uint32_t mode);
+
+/* releases the layout and its word shapes */
+ZHB_EXPORT void zhban_release_layout(zhban_t *zhban, zhban_layout_t *layout);
+
+/* a grid of text rows drawn into a persistent framebuffer, see zhban_screen_open() */
+typedef struct _zhban_screen {
+    void *data;                 /* pixels in the format below, bottom row first, rows not padded */
+    int32_t w, h;               /* in pixels. h is rows times line_step */
+    uint32_t format;            /* ZHBAN_FORMAT_*, other than R8_CLUSTERS */
+    uint32_t rows;              /* first at the top */
+    zhban_rect_t *dirty;        /* changed by the last zhban_screen_update(), top to bottom */
+    uint32_t dirty_count;
+    uint32_t rows_changed;      /* by the last zhban_screen_update() */
+} zhban_screen_t;
+
+/* makes a blank screen: rows of text, line_step apart, baselines descent above their bottoms.
+    w - width in pixels. rows are clipped to it, and to their line_step high slots
+    rows - number of text rows
+    format, color - as for zhban_render_into()
+   return value: NULL on error. */
+ZHB_EXPORT zhban_screen_t *zhban_screen_open(zhban_t *zhban, int32_t w, uint32_t rows, uint32_t format, uint32_t color);
+
+/* takes the next frame: a string per row, empty ones blank. rows whose text differs from the last frame
+   are shaped anew with zhban_shape_batch(), cleared and rendered with zhban_render_into(), the rest are left alone.
+   the screen dirty list then tells which parts of the framebuffer changed, adjacent rows merged together.
+   return value: nonzero on error, in which case rows that failed to shape are left blank. */
+ZHB_EXPORT int zhban_screen_update(zhban_t *zhban, zhban_screen_t *screen, const uint16_t **strings, const uint32_t *strsizes);
+
+/* releases the screen and its row shapes */
+ZHB_EXPORT void zhban_screen_drop(zhban_t *zhban, zhban_screen_t *screen);
+
 /* releases shape structure when it is not further expected to be used in a call to zhban_render() */
 ZHB_EXPORT void zhban_release_shape(zhban_t *zhban, zhban_shape_t *shape);
 
@@ -158,13 +453,79 @@ ZHB_EXPORT zhban_bitmap_t *zhban_render(zhban_t *zhban, zhban_shape_t *shape);
 /* postprocessing callback to mutilate the bitmap/cluster_map data just before it is returned. */
 typedef void (*zhban_postproc_t)(zhban_bitmap_t *b, zhban_shape_t *s, void *ptr);
 
-/* calls the supplied callback to post-process the bitmap. */
+/* calls the supplied callback to post-process the bitmap. bitmaps are cached per shape and variant,
+   variant being the callback and, for zhban_pp_color*(), the color, or else the ptr value. */
 ZHB_EXPORT zhban_bitmap_t *zhban_render_pp(zhban_t *zhban, zhban_shape_t *shape, zhban_postproc_t pproc, void *ptr);
 
-/* postprocessing convertor RG16UI->RGBA8UI, single color. ptr shall point to the desired color (RGBx), uint32_t */
+/* same, but the variant is identified by pproc and the tag, whatever ptr is. variants of a shape are
+   made from its raw (zhban_render()) bitmap if that is in the cache, or else it's rendered and cached
+   for the purpose, unless pproc is one of zhban_pp_color*(). */
+ZHB_EXPORT zhban_bitmap_t *zhban_render_variant(zhban_t *zhban, zhban_shape_t *shape, zhban_postproc_t pproc,
+                                                                                    void *ptr, uint64_t tag);
+
+/* returns cached bitmap in the given format. RG16 is the same as zhban_render().
+   color - 0x00BBGGRR, as with zhban_pp_color(), for the RGBA8 and BGRA8 formats, ignored otherwise.
+   each format (and color) is cached separately, made from the RG16 bitmap if that is in the cache. */
+ZHB_EXPORT zhban_bitmap_t *zhban_render_format(zhban_t *zhban, zhban_shape_t *shape, uint32_t format, uint32_t color);
+
+/* composites the shape straight into a framebuffer, bypassing the bitmap cache. allocates nothing,
+   and takes no locks, so it can be called from any thread that holds a reference to the shape.
+   params:
+    in
+        zhban - which zhban the shape is from
+        shape - shaping results from previous call to zhban_shape()
+        dst - first pixel of the bottom row of the framebuffer, in the format below
+        stride - bytes from a row to the one above it. negative if the top row comes first in memory
+        format - ZHBAN_FORMAT_* other than R8_CLUSTERS
+        color - 0x00BBGGRR for the RGBA8 and BGRA8 formats, ignored otherwise
+        x, y - where the bottom left corner of the shape bounding box goes
+        clip - rectangle outside of which pixels are left alone. must lie within the framebuffer
+   RG16 and R8 pixels get coverage combined in as zhban_render_format() does, premultiplied formats
+   are composited source over. clear the area beforehand to get the same pixels as it renders.
+   return value: nonzero on error.
+*/
+ZHB_EXPORT int zhban_render_into(zhban_t *zhban, zhban_shape_t *shape, void *dst, int32_t stride, uint32_t format,
+                                                uint32_t color, int32_t x, int32_t y, const zhban_rect_t *clip);
+
+/* renders a number of shapes at once, spreading bitmap cache misses over worker threads.
+   params:
+    in
+        zhban - which zhban to render with
+        shapes - shaping results from previous calls to zhban_shape()
+        count - number of them
+        pproc, ptr - post-processor as in zhban_render_pp(), or NULL. called from worker threads.
+    out
+        bitmaps - count pointers, same as zhban_render_pp() would return for each shape, or NULL on error.
+                  all stay valid up until next call to any of zhban_render*() functions.
+*/
+ZHB_EXPORT void zhban_render_batch(zhban_t *zhban, zhban_shape_t **shapes, zhban_bitmap_t **bitmaps, uint32_t count,
+                                                            zhban_postproc_t pproc, void *ptr);
+
+/* sets number of worker threads zhban_render_batch() spawns in addition to the calling one.
+   0 (default) means one less than there are online CPUs. call from the render thread. */
+ZHB_EXPORT void zhban_set_render_threads(zhban_t *zhban, uint32_t nthreads);
+
+/* enables atlas output mode, or wipes the atlas if already enabled. call from the render thread.
+    page_w, page_h - atlas page size in pixels
+    max_pages - page limit. when all of them are full, the atlas is wiped and a new generation starts.
+   return value: nonzero on error.
+*/
+ZHB_EXPORT int zhban_atlas_setup(zhban_t *zhban, uint32_t page_w, uint32_t page_h, uint32_t max_pages);
+
+/* returns atlas page, or NULL if there's no page with such index yet. valid until next zhban_atlas_setup(). */
+ZHB_EXPORT zhban_atlas_page_t *zhban_atlas_page(zhban_t *zhban, uint32_t index);
+
+/* places glyphs of the shape into the atlas if they are not there yet, and returns
+   a quad per non-empty glyph. read-only, valid up until next call to zhban_render_quads().
+   return value: zhban_quads_t or NULL on error (atlas not set up, shape does not fit into the whole of it). */
+ZHB_EXPORT zhban_quads_t *zhban_render_quads(zhban_t *zhban, zhban_shape_t *shape);
+
+/* postprocessing convertor RG16UI->RGBA8UI, single color. ptr shall point to the desired color (RGBx), uint32_t
+   given to zhban_render_pp() or zhban_render_batch(), this and the one below are not called as such:
+   the bitmap is rendered in RGBA8 right away. */
 ZHB_EXPORT void zhban_pp_color(zhban_bitmap_t *bitmap, zhban_shape_t *shape, void *ptr);
 
-/* same as above, but also vertiflips - helper for use in SDL and the like */
+/* same as above, but also vertiflips in place - helper for use in SDL and the like */
 ZHB_EXPORT void zhban_pp_color_vflip(zhban_bitmap_t *bitmap, zhban_shape_t *shape, void *ptr);
 
 /* returns count of valid code points, and an upper bound at invalid codepoint count in an UTF-8 string */